@@ -0,0 +1,32 @@
+# Write the identity of a Mondriaan build as the MONDRIAAN_BUILD_ID define:
+# the git revision of the source and a hash of its uncommitted changes, or
+# FALLBACK outside of a git checkout. The file is only rewritten when the
+# identity changes, so that an unchanged build doesn't recompile anything.
+# Usage: cmake -DSOURCE_DIR=<dir> -DOUTPUT=<file> -DFALLBACK=<id> -P build-id.cmake
+execute_process(COMMAND git rev-parse HEAD
+                WORKING_DIRECTORY ${SOURCE_DIR}
+                RESULT_VARIABLE revisionResult
+                OUTPUT_VARIABLE revision
+                OUTPUT_STRIP_TRAILING_WHITESPACE
+                ERROR_QUIET)
+if(revisionResult EQUAL 0)
+    set(buildID ${revision})
+    execute_process(COMMAND git diff HEAD
+                    WORKING_DIRECTORY ${SOURCE_DIR}
+                    OUTPUT_VARIABLE changes
+                    ERROR_QUIET)
+    if(changes)
+        string(SHA1 changesHash "${changes}")
+        set(buildID "${buildID}+${changesHash}")
+    endif()
+else()
+    set(buildID ${FALLBACK})
+endif()
+
+set(contents "#define MONDRIAAN_BUILD_ID \"${buildID}\"\n")
+if(EXISTS ${OUTPUT})
+    file(READ ${OUTPUT} previousContents)
+endif()
+if(NOT contents STREQUAL previousContents)
+    file(WRITE ${OUTPUT} "${contents}")
+endif()
@@ -0,0 +1,6 @@
+# Write the bytes of a file as a comma separated list, to be included in the
+# initialiser of an array.
+# Usage: cmake -DINPUT=<file> -DOUTPUT=<file> -P embed-file.cmake
+file(READ ${INPUT} contents HEX)
+string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," contents "${contents}")
+file(WRITE ${OUTPUT} "${contents}\n")
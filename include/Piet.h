@@ -4,10 +4,15 @@
 #include <array>
 #include <cassert>
 #include <cstdio>
+#include <deque>
 #include <exception>
+#include <llvm/IR/DIBuilder.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
 #include <png.h>
 #include <string>
 #include <unordered_map>
@@ -28,6 +33,7 @@ enum DirectionPoint : uint8_t {
 };
 
 DirectionPoint incrementDirectionPointer(DirectionPoint direction);
+DirectionPoint toggleCodelChooser(DirectionPoint direction);
 } // namespace Piet
 
 namespace std {
@@ -140,6 +146,10 @@ public:
 
   bool in(Position position);
 
+  uint32_t getRows();
+
+  uint32_t getColumns();
+
 private:
   uint32_t rows;
   uint32_t columns;
@@ -191,6 +201,21 @@ struct GraphStep {
   bool skipTransition = false;
 };
 
+/**
+ * @brief The position of a walk through the graph: the node the walk is at and
+ * the direction in which it will leave the node. Walking the graph from equal
+ * states always yields the same steps. Whether a step skips its colour
+ * transition is a property of the edge it takes, so it's part of the state too.
+ */
+struct GraphState {
+  GraphNode *node;
+  DirectionPoint direction;
+
+  bool operator==(const GraphState &other) const {
+    return node == other.node && direction == other.direction;
+  }
+};
+
 class Graph {
 public:
   Graph(vector<GraphNode *> nodes, GraphNode *initialNode)
@@ -200,6 +225,7 @@ public:
   DirectionPoint getCurrentDirection();
   GraphNode *getInitialNode();
   GraphNode *getCurrentNode();
+  GraphState getCurrentState();
 
 private:
   vector<GraphNode *> nodes;
@@ -235,8 +261,8 @@ private:
 
 class GraphNode {
 public:
-  GraphNode(Color color, uint32_t size, string identifier)
-      : color(color), size(size), identifier(identifier) {}
+  GraphNode(Color color, uint32_t size, string identifier, Position position)
+      : color(color), size(size), identifier(identifier), position(position) {}
   void markAsInitial();
   void markAsTerminal();
   bool isTerminal();
@@ -246,16 +272,31 @@ public:
   Color getColor();
   uint32_t getSize();
   string getIdentifier();
+  //! The codel at which the parser first visited the block.
+  Position getPosition();
 
 private:
   Color color;
   uint32_t size;
   string identifier;
+  Position position;
   unordered_map<DirectionPoint, GraphEdge *> edges;
   bool terminal = false;
   bool initial = false;
 };
 } // namespace Parse
+} // namespace Piet
+
+namespace std {
+template <> struct hash<Piet::Parse::GraphState> {
+  size_t operator()(const Piet::Parse::GraphState &x) const {
+    return hash<Piet::Parse::GraphNode *>()(x.node) ^
+           (hash<Piet::DirectionPoint>()(x.direction) << 1);
+  }
+};
+} // namespace std
+
+namespace Piet {
 
 class ColorTransition {
 public:
@@ -286,12 +327,316 @@ const string OP_NOOP = "noop", OP_PUSH = "push", OP_POP = "pop", OP_ADD = "add",
              OP_DUPLICATE = "duplicate", OP_OUT_CHAR = "out(char)",
              OP_OUT_NUMBER = "out(number)", OP_POINTER = "pointer",
              OP_SWITCH = "switch", OP_IN_NUMBER = "in(number)",
-             OP_DIVIDE = "divide", OP_ROLL = "roll";
+             OP_IN_CHAR = "in(char)", OP_DIVIDE = "divide", OP_ROLL = "roll";
+
+/**
+ * @brief Options controlling the code generated by Piet::Translator.
+ */
+struct TranslatorOptions {
+  //! Translate the whole program into \c main, with a basic block per state
+  //! and a \c switch per pointer/switch instruction, instead of a function
+  //! per branch. The native stack then stays the same size however long the
+  //! program runs.
+  bool singleFunction = false;
+
+  //! Lower the stack machine to inline LLVM IR on a stack owned by the
+  //! module, instead of calling the runtime library for every operation.
+  bool inlineStack = false;
+
+  //! The optimisation level, from 0 to 3 like -O0 to -O3. It selects both the
+  //! LLVM IR pass pipeline and the code generator's optimisation level.
+  unsigned optimisationLevel = 2;
+
+  //! Optimise for size, like -Os. This requires an optimisation level of 2.
+  bool optimiseForSize = false;
+
+  //! The CPU to generate code for, like -mcpu. "native" selects the CPU of
+  //! the host and all of its features.
+  string cpu = "generic";
+
+  //! Comma separated CPU features to enable (+feature) or disable (-feature)
+  //! on top of those of the CPU, like -mattr.
+  string features;
+
+  //! Link the object file with the runtime library into an executable.
+  bool link = false;
+
+  //! The number of threads translating the graph and generating machine
+  //! code. With more than 1, every branch is translated on any of the threads,
+  //! and the module is split into a partition per thread for code generation.
+  unsigned jobs = 1;
+
+  //! Link the runtime library, embedded as LLVM bitcode, into the module
+  //! before optimising it, so that runtime calls can be inlined.
+  bool linkRuntime = false;
+
+  //! Count the outcomes of every pointer/switch instruction while the program
+  //! runs, and write them to a profile when it exits.
+  bool instrument = false;
+
+  //! A profile written by an instrumented program. The dispatch of every
+  //! pointer/switch instruction is ordered and weighted by its outcomes.
+  string profileUse;
+
+  //! The hash of the codels of the program, which names the program in its
+  //! profile.
+  string programHash;
+
+  //! Emit DWARF line info, which locates every operation at the codel block
+  //! it leaves: the line is the row and the column the column of the codel
+  //! the block was first visited at.
+  bool debugInfo = false;
+
+  //! The image the graph was parsed from, named as the source file in debug
+  //! info.
+  string sourceFilename;
+
+  //! When running a program, write the address and size of every compiled
+  //! function to /tmp/perf-<pid>.map for perf.
+  bool perfMap = false;
+};
+
+/**
+ * @brief Piet::Linker links object files generated by Piet::Translator with
+ * the runtime library into an executable.
+ * @paragraph When Mondriaan is built with lld, the executable is linked
+ * statically in-process. Otherwise the C++ compiler driver ($CXX or c++) is
+ * run to link it.
+ */
+class Linker {
+public:
+  /*!
+   * @brief Locate the runtime library. Exits if it cannot be found.
+   */
+  Linker();
+
+  /*!
+   * @brief Link object files into an executable.
+   * @param objectFilenames The object files to link.
+   * @param executableFilename The executable to create.
+   * @return Whether the executable was linked.
+   */
+  bool link(const vector<string> &objectFilenames,
+            const string &executableFilename);
+
+  /*!
+   * @brief Combine object files into a single relocatable object file.
+   * @param objectFilenames The object files to combine.
+   * @param outputFilename The object file to create.
+   * @return Whether the object file was created.
+   */
+  static bool combine(const vector<string> &objectFilenames,
+                      const string &outputFilename);
+
+  /*!
+   * @brief The directory containing libMondriaanRuntime.a:
+   * $MONDRIAAN_RUNTIME_DIR if set, otherwise the directory configured when
+   * Mondriaan was built.
+   */
+  static string runtimeDirectory();
+
+  const string &getRuntimeArchive() const;
+
+private:
+  static bool linkInProcess(const vector<string> &arguments);
+  static bool linkWithDriver(const vector<string> &arguments);
+
+  string runtimeArchive;
+};
+
+/**
+ * @brief Piet::CompileCache keeps the output files of compiled programs in a
+ * directory. Files are keyed by a hash of the codel grid, the Mondriaan and
+ * LLVM versions, the target and the options that change the output.
+ * @paragraph Several processes can share a directory: files are written under
+ * a unique temporary name, then renamed into place.
+ */
+class CompileCache {
+public:
+  explicit CompileCache(string directory) : directory(std::move(directory)) {}
+
+  /*!
+   * @brief The key of a program in the cache.
+   * @param image The codel grid of the program, before it has been parsed.
+   * @param options The options of the translator.
+   * @param onlyIR Whether the output is LLVM IR code.
+   */
+  string key(Parse::Image *image, const TranslatorOptions &options,
+             bool onlyIR);
+
+  /*!
+   * @brief The hash of the codels of a program, in hex.
+   */
+  static string programHash(Parse::Image *image);
+
+  /*!
+   * @brief Copy a cached file to the output file.
+   * @return Whether the cache had a file for the key.
+   */
+  bool restore(const string &key, const string &outputFilename);
+
+  /*!
+   * @brief Store a copy of the output file in the cache.
+   */
+  void store(const string &key, const string &outputFilename);
+
+private:
+  string entryFilename(const string &key);
+
+  string directory;
+};
+
+/**
+ * @brief Piet::Trace records the spans of a compilation as a Chrome trace
+ * event file for --trace, which chrome://tracing and Perfetto can show.
+ * @paragraph Spans nest on the thread they start on, and every thread has a
+ * track of its own. A thread only records spans between startThread and
+ * finishThread. LLVM's pass managers add a span for each pass.
+ */
+class Trace {
+public:
+  /**
+   * @brief A span of the trace from its construction to its destruction, if
+   * its thread is being traced.
+   */
+  class Span {
+  public:
+    explicit Span(const string &name, const string &detail = "",
+                  bool sampled = true);
+    ~Span();
+
+    //! End the span before it's destroyed.
+    void end();
+
+  private:
+    bool active = false;
+  };
+
+  //! Start tracing the main thread. Exits if LLVM can't trace.
+  static void enable();
+  static bool isEnabled();
+
+  //! Trace a thread started by the main thread, until finishThread.
+  static void startThread();
+  static void finishThread();
+
+  //! Write the spans of every finished thread and of the main thread.
+  static bool write(const string &filename);
+};
+
+/**
+ * @brief Piet::TimeReport measures the wall time, CPU time and peak resident
+ * memory growth of each phase of a compilation, for --time-report.
+ * @paragraph Phases are measured on the main thread. The CPU time of a phase
+ * includes the threads it runs. A phase started within another phase isn't
+ * counted as part of it. Every phase is a span of the trace too.
+ */
+class TimeReport {
+public:
+  /**
+   * @brief A phase measured from its construction to its destruction, if a
+   * report is being made.
+   */
+  class Phase {
+  public:
+    explicit Phase(const string &name);
+    ~Phase();
+
+    //! End the phase before it's destroyed.
+    void end();
+
+  private:
+    bool active = false;
+    Trace::Span span;
+  };
+
+  //! Start measuring the phases of this process.
+  static void enable();
+  static bool isEnabled();
+
+  //! Print the measurements of every phase, in the order they first ran.
+  static void print(llvm::raw_ostream &stream);
+};
+
+//! The type of struct mondriaan_context of the runtime library.
+llvm::StructType *runtimeContextType(llvm::LLVMContext &context);
+
+/*!
+ * @brief The runtime context of the program, the first argument of the
+ * function being built.
+ */
+llvm::Value *runtimeContext(llvm::IRBuilder<> &builder);
+
+/**
+ * @brief Piet::InlineStack emits the operations of the Piet stack machine as
+ * inline LLVM IR. It loads and stores the stack of the runtime context
+ * directly, so LLVM can see into and optimise every operation. Only growing
+ * the stack, I/O and bignums call the runtime library.
+ * @paragraph Like the runtime library, an operation that needs more values
+ * than are on the stack is skipped.
+ * @paragraph The values are tagged like those of the runtime library: a small
+ * integer n is stored as n << 1, a bignum as a pointer with its lowest bit
+ * set.
+ */
+class InlineStack {
+public:
+  InlineStack(llvm::LLVMContext &context, llvm::IRBuilder<> &builder,
+              llvm::Module &module)
+      : context(context), builder(builder), module(module) {}
+
+  void registerGlobals(llvm::Function *writeChar, llvm::Function *writeNumber,
+                       llvm::Function *readNumber, llvm::Function *readChar);
+  void translateOperation(const OpKeyType &operation, Parse::GraphStep *step);
+  void push(llvm::Value *value);
+
+  /**
+   * @brief Pop the top value of the stack as the branch selector of a
+   * pointer or switch instruction.
+   * @param branches The number of branches of the instruction.
+   * @return The i8 index of the branch to take, 0 if the stack is empty.
+   */
+  llvm::Value *popSelector(uint8_t branches);
+
+  //! The number of values on the stack.
+  llvm::Value *loadSize();
+
+private:
+  //! The fields of struct mondriaan_stack.
+  enum StackField { VALUES, SIZE, CAPACITY };
+
+  llvm::Value *stackField(StackField field);
+  llvm::Value *loadBase();
+  llvm::Value *slot(llvm::Value *size, uint64_t depth);
+  llvm::BasicBlock *guardDepth(uint64_t depth);
+  //! Whether a value of the stack is a small integer rather than a bignum.
+  llvm::Value *isSmall(llvm::Value *value);
+  llvm::BasicBlock *createBlock(const string &name);
+  void defineRoll();
+
+  llvm::LLVMContext &context;
+  llvm::IRBuilder<> &builder;
+  llvm::Module &module;
+  llvm::Function *reserve = nullptr;
+  llvm::Function *writeChar = nullptr;
+  llvm::Function *writeNumber = nullptr;
+  llvm::Function *readNumber = nullptr;
+  llvm::Function *readChar = nullptr;
+  llvm::Function *multiplyValues = nullptr;
+  llvm::Function *divideValues = nullptr;
+  llvm::Function *selector = nullptr;
+  llvm::Function *rollShift = nullptr;
+  llvm::Function *copy = nullptr;
+  llvm::Function *release = nullptr;
+  llvm::Function *roll = nullptr;
+};
 
 class Translator {
 public:
-  explicit Translator(Parse::Graph *graph)
-      : builder(context), module(llvm::Module("piet", context)), graph(graph) {}
+  explicit Translator(Parse::Graph *graph, TranslatorOptions options = {})
+      : ownedContext(new llvm::LLVMContext), context(*ownedContext),
+        builder(context), module(new llvm::Module("piet", context)),
+        graph(graph), options(options),
+        inlineStack(context, builder, *module) {}
 
   /*!
    * @brief Translate the graph to an executable file or LLVM IR code.
@@ -300,23 +645,154 @@ public:
    */
   void translateToExecutable(string filename, bool onlyIR);
 
+  /*!
+   * @brief The file created by translateToExecutable.
+   * @param filename The output filename.
+   * @param onlyIR Limit output to LLVM IR code.
+   * @param options The options of the translator.
+   */
+  static string outputFilename(const string &filename, bool onlyIR,
+                               const TranslatorOptions &options);
+
+  /*!
+   * @brief Translate the graph and run it in-process with the JIT compiler,
+   * without creating any files. Each branch is translated and compiled when
+   * it is first called, unless the options need the whole program in one
+   * module.
+   * @return The exit code of the program.
+   */
+  int run();
+
+  /*!
+   * @brief The runtime library as LLVM bitcode, linked into programs with
+   * --lto. Empty if Mondriaan was built without clang.
+   */
+  static llvm::StringRef runtimeBitcode();
+
 private:
+  friend class LazyBranchUnit;
+
+  /**
+   * @brief A branch that has been declared, but whose body has yet to be
+   * translated by walking the graph from its entry state. The branch is a
+   * function of its own, unless all code is generated in a single function.
+   */
+  struct PendingBranch {
+    Parse::GraphState entry;
+    llvm::Function *function;
+    llvm::BasicBlock *block;
+  };
+
+  /**
+   * @brief A step of the sequence walked by a branch, and the operation it
+   * translates to.
+   */
+  struct SequenceStep {
+    Parse::GraphStep *step;
+    OpKeyType operation;
+  };
+
+  void translateMain();
+  void translateDeclaredBranch(Parse::GraphState entry, const string &name);
+  std::unique_ptr<llvm::Module> translateBranchModule(Parse::GraphState entry,
+                                                      const string &name);
+  void translateDeclaredBranchesInParallel();
+  void linkRuntime();
+  void createTargetMachine();
+  llvm::TargetMachine *buildTargetMachine() const;
+  void configureModuleTarget();
+  void optimiseModule();
   void translateIRToExecutable(string objectFilename);
-  llvm::Function *translateBranch(Parse::GraphNode *node, DirectionPoint dp);
+  static void emitObject(llvm::Module &objectModule,
+                         llvm::TargetMachine &machine,
+                         llvm::raw_pwrite_stream &dest);
+  vector<string> translateIRToObjects();
+  void translateGraph();
+  void translateBranch(PendingBranch branch);
+  vector<DirectionPoint> dispatchDirections(const OpKeyType &operation,
+                                            DirectionPoint direction);
+  string sequenceKey(Parse::GraphNode *entry,
+                     const vector<SequenceStep> &sequence, size_t loopStart,
+                     const Parse::GraphState *continuation);
+  OpKeyType operationForStep(Parse::GraphStep *step);
+  void translateSequenceOperation(const OpKeyType &operation,
+                                  Parse::GraphStep *step);
+  void translateOperation(const OpKeyType &operation, Parse::GraphStep *step);
+  llvm::Value *translateSelector(const OpKeyType &operation);
+  void pushValue(llvm::Value *value);
+  void materialiseSequenceValues();
+  void translateDispatch(llvm::Value *selector, Parse::GraphNode *node,
+                         const vector<DirectionPoint> &directions);
+  void translateExit();
+  void loadProfile();
+  void translateProfileCount(const string &site, llvm::Value *selector,
+                             size_t outcomes);
+  void translateProfileRegistration();
+  //! Count an operation for $MONDRIAAN_STATS.
+  void translateStatsCount(const OpKeyType &operation);
+  void createDebugInfo();
+  void attachDebugInfo(llvm::Function *function, Parse::GraphNode *node);
+  void translateDebugLocation(Parse::GraphNode *node);
+  void finishDebugInfo();
+  PendingBranch queueBranch(Parse::GraphState entry);
+  llvm::CallInst *translateJump(llvm::Function *branch);
+  llvm::FunctionType *branchType();
+  //! The declaration of a branch translated into another module.
+  llvm::Function *declareBranch(const string &name);
+  static string branchName(Parse::GraphState entry);
   void registerPietGlobals();
 
-  llvm::LLVMContext context;
+  //! The width of the integers the stack holds without a bignum.
+  static const unsigned smallIntegerBits = 63;
+
+  std::unique_ptr<llvm::LLVMContext> ownedContext;
+  llvm::LLVMContext &context;
   llvm::IRBuilder<> builder;
-  llvm::Module module;
+  std::unique_ptr<llvm::Module> module;
   Parse::Graph *graph;
-  unordered_map<string, llvm::Function *> translatedBranches;
+  TranslatorOptions options;
+  llvm::Function *push = nullptr;
+  llvm::Function *duplicate = nullptr;
+  llvm::Function *outChar = nullptr;
+  llvm::Function *outNumber = nullptr;
+  llvm::Function *pointerBranch = nullptr;
+  llvm::Function *switchBranch = nullptr;
+  llvm::Function *inNumber = nullptr;
+  llvm::Function *inChar = nullptr;
+  llvm::Function *multiply = nullptr;
+  llvm::Function *divide = nullptr;
+  llvm::Function *roll = nullptr;
+  llvm::Function *writeChar = nullptr;
+  llvm::Function *writeNumber = nullptr;
+  llvm::Function *readNumber = nullptr;
+  llvm::Function *readChar = nullptr;
+  llvm::Function *profileProgram = nullptr;
+  llvm::Function *profileSite = nullptr;
+  llvm::GlobalVariable *statsEnabled = nullptr;
+  llvm::Function *statsCount = nullptr;
+  llvm::TargetMachine *targetMachine = nullptr;
+  InlineStack inlineStack;
+  llvm::Function *programFunction = nullptr;
+  unordered_map<Parse::GraphState, llvm::Function *> stateFunctions;
+  unordered_map<string, llvm::Function *> sequenceFunctions;
+  unordered_map<Parse::GraphState, llvm::BasicBlock *> stateBlocks;
+  deque<PendingBranch> pendingBranches;
+  bool declareBranches = false;
+  unordered_map<Parse::GraphState, string> branchNames;
+  vector<pair<string, Parse::GraphState>> declaredBranches;
+  vector<llvm::Value *> sequenceValues;
+  unordered_map<string, vector<uint64_t>> profile;
+  std::unique_ptr<llvm::DIBuilder> debugBuilder;
+  llvm::DIFile *debugFile = nullptr;
+  llvm::DICompileUnit *debugUnit = nullptr;
+  vector<string> profileSites;
   const array<array<OpKeyType, 3>, 6> operationTable = {
       array<OpKeyType, 3>{OP_NOOP, OP_PUSH, OP_POP},
       {OP_ADD, OP_SUBTRACT, OP_MULTIPLY},
       {OP_DIVIDE, "mod", "not"},
       {"greater", OP_POINTER, OP_SWITCH},
       {OP_DUPLICATE, OP_ROLL, OP_IN_NUMBER},
-      {"in(char)", OP_OUT_NUMBER, OP_OUT_CHAR}};
+      {OP_IN_CHAR, OP_OUT_NUMBER, OP_OUT_CHAR}};
 };
 } // namespace Piet
 
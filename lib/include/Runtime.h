@@ -1,16 +1,155 @@
 #include <stack>
 #include <stdint.h>
 
-std::stack<uint32_t> &mondriaan_dump_stack();
+// The version of the interface between compiled programs and the runtime
+// library: the functions and structures of this header, and the layout of
+// values. Bump it with every change to them, as cached objects are keyed by it.
+#define MONDRIAAN_RUNTIME_ABI_VERSION 1
 
 extern "C" {
-void mondriaan_runtime_push(uint32_t);
-void mondriaan_runtime_duplicate();
-void mondriaan_runtime_out_char();
-void mondriaan_runtime_out_number();
-uint8_t mondriaan_runtime_pointer();
-void mondriaan_runtime_in_number();
-void mondriaan_runtime_multiply();
-void mondriaan_runtime_divide();
-void mondriaan_runtime_roll();
+// A value of the stack is an integer of 63 bits n, stored as n << 1, or a
+// pointer to a bignum on the heap with its lowest bit set. Arithmetic on
+// small integers checks for overflow and moves on to bignums when needed. A
+// bignum belongs to the stack slot holding it: it's copied when duplicated
+// and freed when consumed.
+typedef int64_t mondriaan_value;
+
+// The Piet stack of the runtime: a contiguous buffer of values, the bottom
+// value first. It doubles its capacity when a push finds it full.
+struct mondriaan_stack {
+  mondriaan_value *values;
+  uint64_t size;
+  uint64_t capacity;
+};
+
+// Everything a running program owns: its stack, its input and output and its
+// statistics. Every operation takes the context of the program it runs for,
+// so that the programs of a process can run at the same time, on a thread
+// each. Only the stack is visible outside of the runtime library.
+struct mondriaan_context_state;
+
+struct mondriaan_context {
+  mondriaan_stack stack;
+  mondriaan_context_state *state;
+};
+
+// A context reading from and writing to the file descriptors input and
+// output. Destroying it flushes the output and writes the statistics, but
+// leaves the file descriptors open.
+mondriaan_context *mondriaan_context_create(int input, int output);
+void mondriaan_context_destroy(mondriaan_context *context);
+
+// Push a number of 63 bits, such as the size of a block.
+void mondriaan_runtime_push(mondriaan_context *context, int64_t number);
+void mondriaan_runtime_duplicate(mondriaan_context *context);
+void mondriaan_runtime_out_char(mondriaan_context *context);
+void mondriaan_runtime_out_number(mondriaan_context *context);
+uint8_t mondriaan_runtime_pointer(mondriaan_context *context);
+uint8_t mondriaan_runtime_switch(mondriaan_context *context);
+void mondriaan_runtime_in_number(mondriaan_context *context);
+void mondriaan_runtime_in_char(mondriaan_context *context);
+void mondriaan_runtime_multiply(mondriaan_context *context);
+void mondriaan_runtime_divide(mondriaan_context *context);
+void mondriaan_runtime_roll(mondriaan_context *context);
+
+// Make room for at least capacity values, doubling the capacity at least. The
+// stack starts with room for $MONDRIAAN_STACK_CAPACITY values, or 1024.
+void mondriaan_runtime_reserve(mondriaan_context *context, uint64_t capacity);
+
+// Slow paths of code generated with the stack inlined into the program. The
+// values passed to them are consumed.
+void mondriaan_runtime_write_char(mondriaan_context *context,
+                                  mondriaan_value value);
+void mondriaan_runtime_write_number(mondriaan_context *context,
+                                    mondriaan_value value);
+bool mondriaan_runtime_read_number(mondriaan_context *context,
+                                   mondriaan_value *value);
+bool mondriaan_runtime_read_char(mondriaan_context *context,
+                                 mondriaan_value *value);
+mondriaan_value mondriaan_runtime_multiply_values(mondriaan_value first,
+                                                  mondriaan_value second);
+// The divisor must not be 0. The quotient is truncated towards 0.
+mondriaan_value mondriaan_runtime_divide_values(mondriaan_value dividend,
+                                                mondriaan_value divisor);
+// The value modulo the number of branches of a pointer or switch.
+uint8_t mondriaan_runtime_selector(mondriaan_value value, uint8_t branches);
+// The number of rolls modulo a depth, between 0 and the depth.
+uint64_t mondriaan_runtime_roll_shift(mondriaan_value rolls, uint64_t depth);
+mondriaan_value mondriaan_runtime_copy(mondriaan_value value);
+void mondriaan_runtime_release(mondriaan_value value);
+
+// Write the buffered output of the program. Output is also written when the
+// buffer is full, before input is read and when the context is destroyed.
+void mondriaan_runtime_flush(mondriaan_context *context);
+
+// Profiling of the outcomes of pointer and switch instructions. An
+// instrumented program registers the hash of its codels, then its sites. When
+// it exits, the counts are added to the profile in $MONDRIAAN_PROFILE, or
+// mondriaan.profile, if that profile is of the same program; a profile of
+// another program is replaced.
+void mondriaan_runtime_profile_program(const char *hash);
+void mondriaan_runtime_profile_site(const char *name, uint64_t *counters,
+                                    uint32_t outcomes);
+bool mondriaan_runtime_write_profile(const char *filename);
+// Write the profile and forget the sites, before their counters go away. A
+// process that unloads an instrumented program calls this first.
+void mondriaan_runtime_finish_profile();
+
+// Statistics of a run, kept per context when $MONDRIAAN_STATS is set: the
+// operations executed, the maximum depth of the stack, how often the stack
+// grew and the bytes of input and output. They are printed to stderr when the
+// context is destroyed, or written as JSON to the file $MONDRIAAN_STATS names.
+extern bool mondriaan_runtime_stats_enabled;
+// Count an operation, by its index in the Piet operation table: hue change * 3
+// + lightness change. depth is the number of values the program holds outside
+// the stack of its context.
+void mondriaan_runtime_count(mondriaan_context *context, uint32_t operation,
+                             uint64_t depth);
+bool mondriaan_runtime_write_stats(mondriaan_context *context,
+                                   const char *filename);
+}
+
+// A copy of the numbers on the stack of a context, with the top number on
+// top. A bignum is copied as its value modulo 2^64.
+std::stack<int64_t> mondriaan_dump_stack(mondriaan_context *context);
+
+// Small integers, from -2^62 up to 2^62.
+inline bool mondriaan_value_is_small(mondriaan_value value) {
+  return (value & 1) == 0;
+}
+
+inline mondriaan_value mondriaan_value_from_small(int64_t number) {
+  return (mondriaan_value)((uint64_t)number << 1);
+}
+
+inline int64_t mondriaan_value_small(mondriaan_value value) {
+  return value >> 1;
+}
+
+// The fast paths of the stack operations. Only pushing onto a full stack
+// leaves them.
+inline void mondriaan_stack_push(mondriaan_context *context,
+                                 mondriaan_value value) {
+  auto &stack = context->stack;
+  if (stack.size == stack.capacity) {
+    mondriaan_runtime_reserve(context, stack.size + 1);
+  }
+  stack.values[stack.size++] = value;
+}
+
+inline bool mondriaan_stack_has(mondriaan_context *context, uint64_t count) {
+  return context->stack.size >= count;
+}
+
+// The value depth values below the top, which must be on the stack.
+inline mondriaan_value mondriaan_stack_peek(mondriaan_context *context,
+                                            uint64_t depth = 0) {
+  auto &stack = context->stack;
+  return stack.values[stack.size - 1 - depth];
+}
+
+// Pop the top value, which must be on the stack.
+inline mondriaan_value mondriaan_stack_pop(mondriaan_context *context) {
+  auto &stack = context->stack;
+  return stack.values[--stack.size];
 }
@@ -1,13 +1,26 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <limits>
 #include <stack>
 #include <stdint.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
+#include "../include/Runtime.h"
+
 // Register operations:
 //  PRIMITIVES:
 //  push i32
 //      push should check if the next stack index is greater than the
-//      stack size; if it is, the stack should first be extended by 10 items.
+//      stack size; if it is, the capacity of the stack is doubled first.
 //      Then set the next stack index to the pushed value.
 //      Finally increment the next stack index.
 //  pop
@@ -60,132 +73,978 @@
 //  in (char), in (number)
 //  out (char), out (number)
 
-typedef uint32_t piet_int;
+// A number too large for a small integer: its sign and its magnitude in limbs
+// of 32 bits, the least significant limb first, without leading zero limbs.
+typedef std::vector<uint32_t> Magnitude;
 
-std::stack<piet_int> stack;
+struct Bignum {
+  bool negative;
+  Magnitude magnitude;
+};
 
-std::stack<piet_int> &mondriaan_dump_stack() { return stack; }
+static Bignum *bignumOf(mondriaan_value value) {
+  return (Bignum *)(value & ~(mondriaan_value)1);
+}
 
-extern "C" {
-void mondriaan_runtime_push(piet_int value) { stack.push(value); }
+static Magnitude magnitudeOf(uint64_t number) {
+  Magnitude magnitude;
+  while (number != 0) {
+    magnitude.push_back((uint32_t)number);
+    number >>= 32;
+  }
+  return magnitude;
+}
+
+static void trim(Magnitude &magnitude) {
+  while (!magnitude.empty() && magnitude.back() == 0) {
+    magnitude.pop_back();
+  }
+}
 
-void mondriaan_runtime_duplicate() {
-  if (stack.empty()) {
+// The sign and magnitude of a value.
+static void decompose(mondriaan_value value, bool &negative,
+                      Magnitude &magnitude) {
+  if (!mondriaan_value_is_small(value)) {
+    negative = bignumOf(value)->negative;
+    magnitude = bignumOf(value)->magnitude;
     return;
   }
 
-  stack.push(stack.top());
+  int64_t number = mondriaan_value_small(value);
+  negative = number < 0;
+  magnitude = magnitudeOf(negative ? 0 - (uint64_t)number : (uint64_t)number);
 }
 
-void mondriaan_runtime_out_char() {
-  if (stack.empty()) {
+// The value of a sign and magnitude: a small integer if it fits in one.
+static mondriaan_value valueOf(bool negative, Magnitude magnitude) {
+  trim(magnitude);
+  if (magnitude.size() <= 2) {
+    uint64_t number = 0;
+    for (size_t limb = 0; limb < magnitude.size(); limb++) {
+      number |= (uint64_t)magnitude[limb] << (32 * limb);
+    }
+    const uint64_t smallLimit = (uint64_t)1 << 62;
+    if (!negative && number < smallLimit) {
+      return mondriaan_value_from_small((int64_t)number);
+    }
+    if (negative && number <= smallLimit) {
+      return mondriaan_value_from_small(-(int64_t)number);
+    }
+  }
+
+  return (mondriaan_value)new Bignum{negative, std::move(magnitude)} | 1;
+}
+
+static int compare(const Magnitude &first, const Magnitude &second) {
+  if (first.size() != second.size()) {
+    return first.size() < second.size() ? -1 : 1;
+  }
+  for (size_t limb = first.size(); limb-- > 0;) {
+    if (first[limb] != second[limb]) {
+      return first[limb] < second[limb] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+static Magnitude multiplyMagnitudes(const Magnitude &first,
+                                    const Magnitude &second) {
+  Magnitude product(first.size() + second.size(), 0);
+  for (size_t i = 0; i < first.size(); i++) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < second.size(); j++) {
+      uint64_t limb =
+          (uint64_t)first[i] * second[j] + product[i + j] + carry;
+      product[i + j] = (uint32_t)limb;
+      carry = limb >> 32;
+    }
+    product[i + second.size()] = (uint32_t)carry;
+  }
+  trim(product);
+  return product;
+}
+
+// Divide a magnitude by a single limb in place, returning the remainder.
+static uint32_t divideBySmall(Magnitude &magnitude, uint32_t divisor) {
+  uint64_t remainder = 0;
+  for (size_t limb = magnitude.size(); limb-- > 0;) {
+    uint64_t dividend = (remainder << 32) | magnitude[limb];
+    magnitude[limb] = (uint32_t)(dividend / divisor);
+    remainder = dividend % divisor;
+  }
+  trim(magnitude);
+  return (uint32_t)remainder;
+}
+
+// Divide a magnitude by a divisor that isn't zero, with Knuth's algorithm D.
+static void divideMagnitudes(const Magnitude &dividend,
+                             const Magnitude &divisor, Magnitude &quotient,
+                             Magnitude &remainder) {
+  if (compare(dividend, divisor) < 0) {
+    quotient.clear();
+    remainder = dividend;
+    return;
+  }
+  if (divisor.size() == 1) {
+    quotient = dividend;
+    remainder = magnitudeOf(divideBySmall(quotient, divisor[0]));
     return;
   }
 
-  std::cout << (char)stack.top();
-  stack.pop();
+  // Both are shifted until the top bit of the divisor is set, so that each
+  // estimated limb of the quotient is at most 2 too large.
+  int shift = __builtin_clz(divisor.back());
+  size_t n = divisor.size(), m = dividend.size() - n;
+  Magnitude u(dividend.size() + 1, 0), v(n, 0);
+  for (size_t limb = 0; limb < dividend.size(); limb++) {
+    u[limb] |= dividend[limb] << shift;
+    if (shift != 0) {
+      u[limb + 1] = dividend[limb] >> (32 - shift);
+    }
+  }
+  for (size_t limb = 0; limb < n; limb++) {
+    v[limb] = divisor[limb] << shift;
+    if (shift != 0 && limb > 0) {
+      v[limb] |= divisor[limb - 1] >> (32 - shift);
+    }
+  }
+
+  const uint64_t base = (uint64_t)1 << 32;
+  quotient.assign(m + 1, 0);
+  for (size_t j = m + 1; j-- > 0;) {
+    uint64_t numerator = ((uint64_t)u[j + n] << 32) | u[j + n - 1];
+    uint64_t estimate = numerator / v[n - 1];
+    uint64_t estimateRemainder = numerator % v[n - 1];
+    while (estimate >= base ||
+           estimate * v[n - 2] > ((estimateRemainder << 32) | u[j + n - 2])) {
+      estimate--;
+      estimateRemainder += v[n - 1];
+      if (estimateRemainder >= base) {
+        break;
+      }
+    }
+
+    // Subtract the estimate times the divisor.
+    uint64_t carry = 0;
+    int64_t borrow = 0;
+    for (size_t limb = 0; limb < n; limb++) {
+      uint64_t product = estimate * v[limb] + carry;
+      carry = product >> 32;
+      int64_t difference =
+          (int64_t)u[limb + j] - (int64_t)(uint32_t)product - borrow;
+      u[limb + j] = (uint32_t)difference;
+      borrow = difference < 0 ? 1 : 0;
+    }
+    int64_t difference = (int64_t)u[j + n] - (int64_t)carry - borrow;
+    u[j + n] = (uint32_t)difference;
+
+    // The estimate was 1 too large: add the divisor back.
+    if (difference < 0) {
+      estimate--;
+      uint64_t sum = 0;
+      for (size_t limb = 0; limb < n; limb++) {
+        sum = (uint64_t)u[limb + j] + v[limb] + (sum >> 32);
+        u[limb + j] = (uint32_t)sum;
+      }
+      u[j + n] += (uint32_t)(sum >> 32);
+    }
+    quotient[j] = (uint32_t)estimate;
+  }
+  trim(quotient);
+
+  remainder.assign(n, 0);
+  for (size_t limb = 0; limb < n; limb++) {
+    remainder[limb] = u[limb] >> shift;
+    if (shift != 0) {
+      remainder[limb] |= u[limb + 1] << (32 - shift);
+    }
+  }
+  trim(remainder);
+}
+
+std::stack<int64_t> mondriaan_dump_stack(mondriaan_context *context) {
+  std::stack<int64_t> dump;
+  for (uint64_t index = 0; index < context->stack.size; index++) {
+    auto value = context->stack.values[index];
+    if (mondriaan_value_is_small(value)) {
+      dump.push(mondriaan_value_small(value));
+      continue;
+    }
+
+    auto bignum = bignumOf(value);
+    uint64_t number = bignum->magnitude[0];
+    if (bignum->magnitude.size() > 1) {
+      number |= (uint64_t)bignum->magnitude[1] << 32;
+    }
+    dump.push((int64_t)(bignum->negative ? 0 - number : number));
+  }
+  return dump;
+}
+
+// The statistics of $MONDRIAAN_STATS, by the index of the operation in the
+// Piet operation table.
+static const char *const operationNames[] = {
+    "noop",      "push",        "pop",         // lightness change 0, 1 and 2
+    "add",       "subtract",    "multiply",    // hue change 1
+    "divide",    "mod",         "not",         // hue change 2
+    "greater",   "pointer",     "switch",      // hue change 3
+    "duplicate", "roll",        "in(number)",  // hue change 4
+    "in(char)",  "out(number)", "out(char)"};  // hue change 5
+static const uint32_t operationCount =
+    sizeof(operationNames) / sizeof(operationNames[0]);
+
+struct Stats {
+  uint64_t operations[operationCount] = {};
+  uint64_t maxDepth = 0;
+  uint64_t growths = 0;
+  uint64_t inputBytes = 0;
+  uint64_t outputBytes = 0;
+};
+
+bool mondriaan_runtime_stats_enabled =
+    std::getenv("MONDRIAAN_STATS") != nullptr;
+
+// The part of a context only the runtime library sees: the input, output and
+// statistics of the program.
+struct mondriaan_context_state {
+  int input;
+  int output;
+
+  // The output is buffered here and written with write(2) when the buffer is
+  // full, before every input operation and when the context is destroyed.
+  char outputBuffer[64 * 1024];
+  size_t outputLength = 0;
+
+  // A regular file as input is mapped into memory as a whole, any other input
+  // is read through a buffer with read(2). The output is flushed by every
+  // input operation, even one the buffer serves, so that a prompt is seen
+  // before the program waits for an answer, and output and input interleave
+  // on a terminal in the order the program ran them.
+  char inputBuffer[64 * 1024];
+  const char *inputNext = inputBuffer;
+  const char *inputEnd = inputBuffer;
+  bool inputMapped = false;
+  bool inputEnded = false;
+  void *mapping = nullptr;
+  size_t mappingLength = 0;
+
+  Stats stats;
+};
+
+static void printStat(const char *name, uint64_t value) {
+  std::cerr << "  " << std::left << std::setw(16) << name << std::right
+            << std::setw(16) << value << "\n";
 }
 
-void mondriaan_runtime_out_number() {
-  if (stack.empty()) {
+static void writeStats(mondriaan_context *context) {
+  Stats &stats = context->state->stats;
+  stats.maxDepth = std::max(stats.maxDepth, context->stack.size);
+
+  // A filename asks for JSON, anything else for a summary on stderr. The host
+  // may have unset the variable since the statistics were enabled.
+  const char *variable = std::getenv("MONDRIAAN_STATS");
+  std::string destination = variable != nullptr ? variable : "";
+  if (destination != "" && destination != "1" && destination != "stderr") {
+    if (!mondriaan_runtime_write_stats(context, destination.c_str())) {
+      std::cerr << "Could not write the statistics." << std::endl;
+    }
     return;
   }
 
-  std::cout << stack.top();
-  stack.pop();
+  uint64_t total = 0;
+  std::cerr << "=== Mondriaan runtime statistics ===\n";
+  for (uint32_t operation = 0; operation < operationCount; operation++) {
+    if (stats.operations[operation] != 0) {
+      printStat(operationNames[operation], stats.operations[operation]);
+      total += stats.operations[operation];
+    }
+  }
+  printStat("Operations", total);
+  printStat("Max stack depth", stats.maxDepth);
+  printStat("Stack growths", stats.growths);
+  printStat("Input bytes", stats.inputBytes);
+  printStat("Output bytes", stats.outputBytes);
 }
 
-uint8_t mondriaan_runtime_pointer() {
-  if (stack.empty()) {
-    return 0;
+// The capacity of the stack before its first push, unless
+// $MONDRIAAN_STACK_CAPACITY asks for another.
+static const uint64_t defaultStackCapacity = 1024;
+
+static uint64_t initialStackCapacity() {
+  auto capacity = std::getenv("MONDRIAAN_STACK_CAPACITY");
+  if (capacity == nullptr) {
+    return defaultStackCapacity;
   }
 
-  auto top = stack.top();
-  stack.pop();
+  auto parsedCapacity = std::strtoull(capacity, nullptr, 10);
+  return parsedCapacity > 0 ? parsedCapacity : defaultStackCapacity;
+}
 
-  return (uint8_t)(top % 4);
+static void writeOutput(mondriaan_context *context, const char *bytes,
+                        size_t length) {
+  auto state = context->state;
+  while (length > 0) {
+    if (state->outputLength == sizeof(state->outputBuffer)) {
+      mondriaan_runtime_flush(context);
+    }
+    size_t copied =
+        std::min(length, sizeof(state->outputBuffer) - state->outputLength);
+    std::memcpy(state->outputBuffer + state->outputLength, bytes, copied);
+    state->outputLength += copied;
+    bytes += copied;
+    length -= copied;
+  }
 }
 
-void mondriaan_runtime_in_number() {
-  std::string line;
-  std::getline(std::cin, line);
-  try {
-    stack.push((piet_int)std::stoul(line));
-  } catch (...) {
-    // Ignore
+static bool mapInput(mondriaan_context_state *state) {
+  struct stat status;
+  if (fstat(state->input, &status) != 0 || !S_ISREG(status.st_mode)) {
+    return false;
+  }
+  auto offset = lseek(state->input, 0, SEEK_CUR);
+  if (offset < 0 || offset >= status.st_size) {
+    return false;
+  }
+
+  // The mapping starts at the beginning of the file, as its offset has to
+  // be a multiple of the page size.
+  void *mapping = mmap(nullptr, (size_t)status.st_size, PROT_READ,
+                       MAP_PRIVATE, state->input, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+
+  state->mapping = mapping;
+  state->mappingLength = (size_t)status.st_size;
+  state->inputNext = (const char *)mapping + offset;
+  state->inputEnd = (const char *)mapping + status.st_size;
+  state->stats.inputBytes += (uint64_t)(state->inputEnd - state->inputNext);
+  lseek(state->input, 0, SEEK_END);
+  return true;
+}
+
+static bool refillInput(mondriaan_context *context) {
+  auto state = context->state;
+  if (state->inputEnded) {
+    return false;
+  }
+
+  if (!state->inputMapped) {
+    state->inputMapped = true;
+    if (mapInput(state)) {
+      return true;
+    }
+  }
+
+  // Bytes that were peeked at but not read yet stay in front of the new ones.
+  auto pending = (size_t)(state->inputEnd - state->inputNext);
+  memmove(state->inputBuffer, state->inputNext, pending);
+  state->inputNext = state->inputBuffer;
+  state->inputEnd = state->inputBuffer + pending;
+
+  while (true) {
+    auto result = read(state->input, state->inputBuffer + pending,
+                       sizeof(state->inputBuffer) - pending);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      state->inputEnded = true;
+      return false;
+    }
+
+    state->inputEnd += result;
+    state->stats.inputBytes += (uint64_t)result;
+    return true;
+  }
+}
+
+// The byte ahead bytes after the next byte of the input, or -1 at its end.
+// Only a few bytes can be looked ahead at.
+static inline int peekInput(mondriaan_context *context, size_t ahead = 0) {
+  auto state = context->state;
+  while ((size_t)(state->inputEnd - state->inputNext) <= ahead) {
+    if (!refillInput(context)) {
+      return -1;
+    }
+  }
+  return (unsigned char)state->inputNext[ahead];
+}
+
+static inline bool isSpace(int byte) {
+  return byte == ' ' || (byte >= '\t' && byte <= '\r');
+}
+
+// The outcome counters of every pointer/switch instruction of an instrumented
+// program, by the name of its dispatch state.
+struct ProfileSite {
+  std::string name;
+  uint64_t *counters;
+  uint32_t outcomes;
+};
+
+std::vector<ProfileSite> profileSites;
+// The hash of the codels of the instrumented program, which heads its profile.
+std::string profileProgram;
+
+extern "C" {
+mondriaan_context *mondriaan_context_create(int input, int output) {
+  auto context = new mondriaan_context{{nullptr, 0, 0}, nullptr};
+  context->state = new mondriaan_context_state;
+  context->state->input = input;
+  context->state->output = output;
+  return context;
+}
+
+void mondriaan_context_destroy(mondriaan_context *context) {
+  mondriaan_runtime_flush(context);
+  if (mondriaan_runtime_stats_enabled) {
+    writeStats(context);
+  }
+
+  auto &stack = context->stack;
+  for (uint64_t index = 0; index < stack.size; index++) {
+    mondriaan_runtime_release(stack.values[index]);
+  }
+  std::free(stack.values);
+  if (context->state->mapping != nullptr) {
+    munmap(context->state->mapping, context->state->mappingLength);
+  }
+  delete context->state;
+  delete context;
+}
+
+void mondriaan_runtime_reserve(mondriaan_context *context, uint64_t capacity) {
+  auto &stack = context->stack;
+  if (capacity <= stack.capacity) {
     return;
   }
+
+  // Doubling the capacity keeps the cost of growing constant per push.
+  uint64_t grownCapacity = std::max(capacity, 2 * stack.capacity);
+  if (stack.values == nullptr) {
+    grownCapacity = std::max(grownCapacity, initialStackCapacity());
+  }
+
+  if (stack.values != nullptr) {
+    context->state->stats.growths++;
+  }
+  auto grown = (mondriaan_value *)std::realloc(
+      stack.values, grownCapacity * sizeof(mondriaan_value));
+  if (grown == nullptr) {
+    std::cerr << "Out of memory for a stack of " << grownCapacity << " values"
+              << std::endl;
+    std::exit(1);
+  }
+
+  stack.values = grown;
+  stack.capacity = grownCapacity;
 }
 
-void mondriaan_runtime_multiply() {
-  if (stack.size() < 2) {
+void mondriaan_runtime_push(mondriaan_context *context, int64_t number) {
+  mondriaan_stack_push(context, mondriaan_value_from_small(number));
+}
+
+void mondriaan_runtime_duplicate(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 1)) {
     return;
   }
 
-  auto op1 = stack.top();
-  stack.pop();
-  auto op2 = stack.top();
-  stack.pop();
+  mondriaan_stack_push(context,
+                       mondriaan_runtime_copy(mondriaan_stack_peek(context)));
+}
+
+mondriaan_value mondriaan_runtime_copy(mondriaan_value value) {
+  if (mondriaan_value_is_small(value)) {
+    return value;
+  }
+
+  return (mondriaan_value) new Bignum(*bignumOf(value)) | 1;
+}
+
+void mondriaan_runtime_release(mondriaan_value value) {
+  if (!mondriaan_value_is_small(value)) {
+    delete bignumOf(value);
+  }
+}
+
+void mondriaan_runtime_flush(mondriaan_context *context) {
+  auto state = context->state;
+  size_t written = 0;
+  while (written < state->outputLength) {
+    auto result = write(state->output, state->outputBuffer + written,
+                        state->outputLength - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      // The output can't be written, e.g. because it was closed.
+      break;
+    }
+    written += (size_t)result;
+  }
+  state->stats.outputBytes += written;
+  state->outputLength = 0;
+}
+
+void mondriaan_runtime_write_char(mondriaan_context *context,
+                                  mondriaan_value value) {
+  // A character is written as UTF-8, so that it reads back as the same
+  // character. A value that isn't a character is written as the replacement
+  // character U+FFFD.
+  int64_t codePoint = 0xFFFD;
+  if (mondriaan_value_is_small(value)) {
+    int64_t number = mondriaan_value_small(value);
+    bool surrogate = number >= 0xD800 && number < 0xE000;
+    if (number >= 0 && number <= 0x10FFFF && !surrogate) {
+      codePoint = number;
+    }
+  } else {
+    delete bignumOf(value);
+  }
+
+  auto state = context->state;
+  if (codePoint < 0x80) {
+    if (state->outputLength == sizeof(state->outputBuffer)) {
+      mondriaan_runtime_flush(context);
+    }
+    state->outputBuffer[state->outputLength++] = (char)codePoint;
+    return;
+  }
 
-  stack.push(op1 * op2);
+  // The lead byte holds the highest bits, each continuation byte 6 more.
+  char bytes[4];
+  size_t length = codePoint < 0x800 ? 2 : codePoint < 0x10000 ? 3 : 4;
+  const unsigned char leads[] = {0, 0, 0xC0, 0xE0, 0xF0};
+  bytes[0] = (char)(leads[length] | (codePoint >> (6 * (length - 1))));
+  for (size_t index = 1; index < length; index++) {
+    bytes[index] =
+        (char)(0x80 | ((codePoint >> (6 * (length - 1 - index))) & 0x3F));
+  }
+  writeOutput(context, bytes, length);
 }
 
-void mondriaan_runtime_divide() {
-  if (stack.size() < 2) {
+void mondriaan_runtime_write_number(mondriaan_context *context,
+                                    mondriaan_value value) {
+  if (mondriaan_value_is_small(value)) {
+    // The digits are formatted from the last to the first.
+    int64_t number = mondriaan_value_small(value);
+    uint64_t magnitude = number < 0 ? 0 - (uint64_t)number : (uint64_t)number;
+    char digits[20];
+    char *first = digits + sizeof(digits);
+    do {
+      *--first = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude != 0);
+    if (number < 0) {
+      *--first = '-';
+    }
+
+    writeOutput(context, first, (size_t)(digits + sizeof(digits) - first));
     return;
   }
 
-  auto divisor = stack.top();
-  stack.pop();
-  auto dividend = stack.top();
-  stack.pop();
+  // A bignum is split into groups of 9 digits, from the last to the first.
+  auto bignum = bignumOf(value);
+  std::vector<uint32_t> groups;
+  while (!bignum->magnitude.empty()) {
+    groups.push_back(divideBySmall(bignum->magnitude, 1000000000));
+  }
 
-  stack.push(dividend / divisor);
+  std::string digits = bignum->negative ? "-" : "";
+  digits += std::to_string(groups.back());
+  for (size_t group = groups.size() - 1; group-- > 0;) {
+    auto groupDigits = std::to_string(groups[group]);
+    digits.append(9 - groupDigits.size(), '0');
+    digits += groupDigits;
+  }
+  writeOutput(context, digits.data(), digits.size());
+  delete bignum;
 }
 
-void mondriaan_runtime_roll() {
-  // A roll is only useful if there exists:
-  // 1st = number of rolls
-  // 2nd = depth of rolls
-  // 3rd and more = values to roll. A single value is rolled to itself.
-  if (stack.size() < 3) {
+bool mondriaan_runtime_read_number(mondriaan_context *context,
+                                   mondriaan_value *value) {
+  auto state = context->state;
+  mondriaan_runtime_flush(context);
+  // A number is an optional sign and digits, after any whitespace. Input
+  // that isn't a number is left to be read by in(char), and nothing is read.
+  int byte = peekInput(context);
+  while (isSpace(byte)) {
+    state->inputNext++;
+    byte = peekInput(context);
+  }
+
+  // A sign is only read with the digit after it.
+  bool negative = byte == '-';
+  if (byte == '-' || byte == '+') {
+    int digit = peekInput(context, 1);
+    if (digit < '0' || digit > '9') {
+      return false;
+    }
+    state->inputNext++;
+    byte = digit;
+  }
+  if (byte < '0' || byte > '9') {
+    return false;
+  }
+
+  // The digits are collected in a small integer while they fit in one.
+  const uint64_t smallLimit = (uint64_t)1 << 62;
+  uint64_t number = 0;
+  Magnitude magnitude;
+  while (byte >= '0' && byte <= '9') {
+    auto digit = (uint32_t)(byte - '0');
+    if (magnitude.empty() && number < smallLimit / 10) {
+      number = number * 10 + digit;
+    } else {
+      if (magnitude.empty()) {
+        magnitude = magnitudeOf(number);
+      }
+      uint64_t carry = digit;
+      for (auto &limb : magnitude) {
+        carry += (uint64_t)limb * 10;
+        limb = (uint32_t)carry;
+        carry >>= 32;
+      }
+      if (carry != 0) {
+        magnitude.push_back((uint32_t)carry);
+      }
+    }
+    state->inputNext++;
+    byte = peekInput(context);
+  }
+
+  *value = valueOf(negative,
+                   magnitude.empty() ? magnitudeOf(number) : magnitude);
+  return true;
+}
+
+bool mondriaan_runtime_read_char(mondriaan_context *context,
+                                 mondriaan_value *value) {
+  auto state = context->state;
+  mondriaan_runtime_flush(context);
+  // A character is read as UTF-8. A malformed sequence reads as the
+  // replacement character U+FFFD, up to the byte that breaks it.
+  int byte = peekInput(context);
+  if (byte < 0) {
+    return false;
+  }
+  state->inputNext++;
+
+  const int64_t replacement = 0xFFFD;
+  int continuations;
+  int64_t codePoint;
+  if (byte < 0x80) {
+    *value = mondriaan_value_from_small(byte);
+    return true;
+  } else if (byte >= 0xC2 && byte < 0xE0) {
+    continuations = 1;
+    codePoint = byte & 0x1F;
+  } else if (byte >= 0xE0 && byte < 0xF0) {
+    continuations = 2;
+    codePoint = byte & 0x0F;
+  } else if (byte >= 0xF0 && byte < 0xF5) {
+    continuations = 3;
+    codePoint = byte & 0x07;
+  } else {
+    *value = mondriaan_value_from_small(replacement);
+    return true;
+  }
+
+  for (int continuation = 0; continuation < continuations; continuation++) {
+    byte = peekInput(context);
+    if (byte < 0 || (byte & 0xC0) != 0x80) {
+      *value = mondriaan_value_from_small(replacement);
+      return true;
+    }
+    codePoint = (codePoint << 6) | (byte & 0x3F);
+    state->inputNext++;
+  }
+
+  // Overlong encodings and surrogates aren't characters.
+  bool overlong = (continuations == 2 && codePoint < 0x800) ||
+                  (continuations == 3 && codePoint < 0x10000);
+  bool surrogate = codePoint >= 0xD800 && codePoint < 0xE000;
+  *value = mondriaan_value_from_small(
+      overlong || surrogate || codePoint > 0x10FFFF ? replacement : codePoint);
+  return true;
+}
+
+bool mondriaan_runtime_write_profile(const char *filename) {
+  // The first line names the program. Each line after it holds the name of a
+  // site followed by the count of each outcome.
+  std::ofstream profile(filename);
+  profile << "program " << profileProgram << "\n";
+  for (auto &site : profileSites) {
+    profile << site.name;
+    for (uint32_t outcome = 0; outcome < site.outcomes; outcome++) {
+      profile << " " << site.counters[outcome];
+    }
+    profile << "\n";
+  }
+
+  profile.close();
+  return !profile.fail();
+}
+
+void mondriaan_runtime_finish_profile() {
+  if (profileProgram.empty()) {
     return;
   }
 
-  auto rolls = stack.top();
-  stack.pop();
-  auto depth = stack.top();
-  stack.pop();
+  const char *filename = std::getenv("MONDRIAAN_PROFILE");
+  if (filename == nullptr) {
+    filename = "mondriaan.profile";
+  }
+
+  // The counts of earlier runs of the same program are added up, so that a
+  // profile can cover several inputs. The profile of another program, or of
+  // an earlier version of this one, is replaced.
+  std::ifstream earlierProfile(filename);
+  std::string header;
+  std::getline(earlierProfile, header);
+  std::string name;
+  while (header == "program " + profileProgram && earlierProfile >> name) {
+    for (auto &site : profileSites) {
+      if (site.name != name) {
+        continue;
+      }
+      for (uint32_t outcome = 0; outcome < site.outcomes; outcome++) {
+        uint64_t count = 0;
+        earlierProfile >> count;
+        site.counters[outcome] += count;
+      }
+    }
+    earlierProfile.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+  earlierProfile.close();
+
+  if (!mondriaan_runtime_write_profile(filename)) {
+    std::cerr << "Could not write the profile." << std::endl;
+  }
+  profileProgram.clear();
+  profileSites.clear();
+}
+
+void mondriaan_runtime_count(mondriaan_context *context, uint32_t operation,
+                             uint64_t depth) {
+  Stats &stats = context->state->stats;
+  stats.operations[operation]++;
+  depth += context->stack.size;
+  if (depth > stats.maxDepth) {
+    stats.maxDepth = depth;
+  }
+}
+
+bool mondriaan_runtime_write_stats(mondriaan_context *context,
+                                   const char *filename) {
+  const Stats &stats = context->state->stats;
+  std::ofstream json(filename);
+  json << "{\n  \"operations\": {";
+  for (uint32_t operation = 0; operation < operationCount; operation++) {
+    json << (operation == 0 ? "\n" : ",\n") << "    \""
+         << operationNames[operation]
+         << "\": " << stats.operations[operation];
+  }
+  json << "\n  },\n"
+       << "  \"max_stack_depth\": " << stats.maxDepth << ",\n"
+       << "  \"stack_growths\": " << stats.growths << ",\n"
+       << "  \"input_bytes\": " << stats.inputBytes << ",\n"
+       << "  \"output_bytes\": " << stats.outputBytes << "\n}\n";
+
+  json.close();
+  return !json.fail();
+}
 
-  // A roll can have no effect at all.
-  if (rolls > depth) {
-    rolls %= depth;
+void mondriaan_runtime_profile_program(const char *hash) {
+  static bool registered = false;
+  if (!registered) {
+    registered = true;
+    std::atexit(mondriaan_runtime_finish_profile);
   }
-  if (rolls == 0) {
-    std::cout << "Zero rolls!" << std::endl;
+  profileProgram = hash;
+}
+
+void mondriaan_runtime_profile_site(const char *name, uint64_t *counters,
+                                    uint32_t outcomes) {
+  profileSites.push_back(ProfileSite{name, counters, outcomes});
+}
+
+void mondriaan_runtime_out_char(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 1)) {
     return;
   }
-  if (depth > stack.size()) {
-    std::cout << "Greater than stack size?" << std::endl;
+
+  mondriaan_runtime_write_char(context, mondriaan_stack_pop(context));
+}
+
+void mondriaan_runtime_out_number(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 1)) {
     return;
   }
 
-  // Apply the roll by collecting the relevant values, rearranging them
-  // and then reinserting them.
-  std::vector<piet_int> rollValues{};
-  for (uint32_t valuePop = 0; valuePop < depth; valuePop++) {
-    rollValues.push_back(stack.top());
-    stack.pop();
+  mondriaan_runtime_write_number(context, mondriaan_stack_pop(context));
+}
+
+uint8_t mondriaan_runtime_pointer(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 1)) {
+    return 0;
+  }
+
+  return mondriaan_runtime_selector(mondriaan_stack_pop(context), 4);
+}
+
+uint8_t mondriaan_runtime_switch(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 1)) {
+    return 0;
+  }
+
+  return mondriaan_runtime_selector(mondriaan_stack_pop(context), 2);
+}
+
+uint8_t mondriaan_runtime_selector(mondriaan_value value, uint8_t branches) {
+  // The number of branches is a power of 2, so the lowest bits of the
+  // two's complement of the value are its remainder.
+  if (mondriaan_value_is_small(value)) {
+    return (uint8_t)(mondriaan_value_small(value) & (branches - 1));
+  }
+
+  auto bignum = bignumOf(value);
+  auto lowest = (uint8_t)(bignum->magnitude[0] & (branches - 1));
+  auto selector =
+      bignum->negative ? (uint8_t)((branches - lowest) & (branches - 1))
+                       : lowest;
+  delete bignum;
+  return selector;
+}
+
+void mondriaan_runtime_in_number(mondriaan_context *context) {
+  mondriaan_value value;
+  if (mondriaan_runtime_read_number(context, &value)) {
+    mondriaan_stack_push(context, value);
+  }
+}
+
+void mondriaan_runtime_in_char(mondriaan_context *context) {
+  mondriaan_value value;
+  if (mondriaan_runtime_read_char(context, &value)) {
+    mondriaan_stack_push(context, value);
+  }
+}
+
+mondriaan_value mondriaan_runtime_multiply_values(mondriaan_value first,
+                                                  mondriaan_value second) {
+  // A small integer times a tagged small integer is their tagged product. It
+  // overflows exactly when the product doesn't fit in a small integer.
+  mondriaan_value product;
+  if (mondriaan_value_is_small(first) && mondriaan_value_is_small(second) &&
+      !__builtin_mul_overflow(mondriaan_value_small(first), second,
+                              &product)) {
+    return product;
+  }
+
+  bool firstNegative, secondNegative;
+  Magnitude firstMagnitude, secondMagnitude;
+  decompose(first, firstNegative, firstMagnitude);
+  decompose(second, secondNegative, secondMagnitude);
+  mondriaan_runtime_release(first);
+  mondriaan_runtime_release(second);
+  return valueOf(firstNegative != secondNegative,
+                 multiplyMagnitudes(firstMagnitude, secondMagnitude));
+}
+
+mondriaan_value mondriaan_runtime_divide_values(mondriaan_value dividend,
+                                                mondriaan_value divisor) {
+  // Only the smallest integer divided by -1 doesn't fit in a small integer.
+  const int64_t smallest = -((int64_t)1 << 62);
+  if (mondriaan_value_is_small(dividend) && mondriaan_value_is_small(divisor) &&
+      !(mondriaan_value_small(dividend) == smallest &&
+        mondriaan_value_small(divisor) == -1)) {
+    return mondriaan_value_from_small(mondriaan_value_small(dividend) /
+                                      mondriaan_value_small(divisor));
+  }
+
+  bool dividendNegative, divisorNegative;
+  Magnitude dividendMagnitude, divisorMagnitude, quotient, remainder;
+  decompose(dividend, dividendNegative, dividendMagnitude);
+  decompose(divisor, divisorNegative, divisorMagnitude);
+  mondriaan_runtime_release(dividend);
+  mondriaan_runtime_release(divisor);
+  divideMagnitudes(dividendMagnitude, divisorMagnitude, quotient, remainder);
+  return valueOf(dividendNegative != divisorNegative, quotient);
+}
+
+uint64_t mondriaan_runtime_roll_shift(mondriaan_value rolls, uint64_t depth) {
+  if (mondriaan_value_is_small(rolls)) {
+    auto shift = mondriaan_value_small(rolls) % (int64_t)depth;
+    return (uint64_t)(shift < 0 ? shift + (int64_t)depth : shift);
+  }
+
+  auto bignum = bignumOf(rolls);
+  Magnitude quotient, remainder;
+  divideMagnitudes(bignum->magnitude, magnitudeOf(depth), quotient, remainder);
+  uint64_t shift = 0;
+  for (size_t limb = 0; limb < remainder.size(); limb++) {
+    shift |= (uint64_t)remainder[limb] << (32 * limb);
+  }
+  if (bignum->negative && shift != 0) {
+    shift = depth - shift;
+  }
+  delete bignum;
+  return shift;
+}
+
+void mondriaan_runtime_multiply(mondriaan_context *context) {
+  if (!mondriaan_stack_has(context, 2)) {
+    return;
+  }
+
+  auto op1 = mondriaan_stack_pop(context);
+  auto op2 = mondriaan_stack_pop(context);
+
+  mondriaan_stack_push(context, mondriaan_runtime_multiply_values(op2, op1));
+}
+
+void mondriaan_runtime_divide(mondriaan_context *context) {
+  // Division by zero is skipped.
+  if (!mondriaan_stack_has(context, 2) || mondriaan_stack_peek(context) == 0) {
+    return;
   }
 
-  for (uint32_t roll = 0; roll < rolls; roll++) {
-    piet_int top = rollValues[0];
-    rollValues.erase(rollValues.begin());
-    rollValues.push_back(top);
+  auto divisor = mondriaan_stack_pop(context);
+  auto dividend = mondriaan_stack_pop(context);
+
+  mondriaan_stack_push(context,
+                       mondriaan_runtime_divide_values(dividend, divisor));
+}
+
+void mondriaan_runtime_roll(mondriaan_context *context) {
+  // A roll is only useful if there exists:
+  // 1st = number of rolls
+  // 2nd = depth of rolls
+  // 3rd and more = values to roll. A single value is rolled to itself.
+  if (!mondriaan_stack_has(context, 3)) {
+    return;
   }
 
-  for (uint32_t insertIndex = depth; insertIndex > 0; insertIndex--) {
-    stack.push(rollValues[insertIndex - 1]);
+  auto rolls = mondriaan_stack_pop(context);
+  auto depth = mondriaan_stack_pop(context);
+
+  // A roll deeper than the stack, or of a negative depth, has no effect. A
+  // bignum depth is deeper than any stack.
+  if (!mondriaan_value_is_small(depth) || mondriaan_value_small(depth) <= 0 ||
+      !mondriaan_stack_has(context, (uint64_t)mondriaan_value_small(depth))) {
+    mondriaan_runtime_release(rolls);
+    mondriaan_runtime_release(depth);
+    return;
   }
+
+  // A roll buries the top value at the depth, a negative roll brings the
+  // value at the depth to the top. Rolling depth times has no effect, so the
+  // values are rotated once, in place, however many rolls there are.
+  auto smallDepth = (uint64_t)mondriaan_value_small(depth);
+  auto shift = mondriaan_runtime_roll_shift(rolls, smallDepth);
+  auto end = context->stack.values + context->stack.size;
+  std::rotate(end - smallDepth, end - shift, end);
 }
 }
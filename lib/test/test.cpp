@@ -1,7 +1,12 @@
 #define BOOST_TEST_MAIN
 #include <array>
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
+#include <cstdlib>
+#include <fcntl.h>
+#include <fstream>
 #include <stack>
+#include <unistd.h>
 
 #include "../include/Runtime.h"
 
@@ -10,29 +15,41 @@
 using namespace std;
 
 struct TestFixture {
-  TestFixture() : runtimeStack(mondriaan_dump_stack()) {}
-  ~TestFixture() {
-    while (!runtimeStack.empty()) {
-      runtimeStack.pop();
-    }
-  }
+  TestFixture()
+      : context(mondriaan_context_create(STDIN_FILENO, STDOUT_FILENO)) {}
+  ~TestFixture() { mondriaan_context_destroy(context); }
 
-  std::stack<uint32_t> &runtimeStack;
+  mondriaan_context *context;
 };
 
 BOOST_FIXTURE_TEST_CASE(test_simple_push, TestFixture) {
-  mondriaan_runtime_push(42);
+  mondriaan_runtime_push(context, 42);
 
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK(stack.size() == 1);
   BOOST_CHECK(stack.top() == 42);
 }
 
+BOOST_FIXTURE_TEST_CASE(test_push_beyond_capacity, TestFixture) {
+  // The stack keeps its values when it grows.
+  const uint32_t values = 5000;
+  for (uint32_t value = 0; value < values; value++) {
+    mondriaan_runtime_push(context, value);
+  }
+
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK_EQUAL(values, stack.size());
+  for (uint32_t value = values; value > 0; value--) {
+    BOOST_CHECK_EQUAL(value - 1, stack.top());
+    stack.pop();
+  }
+}
+
 BOOST_FIXTURE_TEST_CASE(test_duplicate_value, TestFixture) {
-  mondriaan_runtime_push(1);
-  mondriaan_runtime_duplicate();
+  mondriaan_runtime_push(context, 1);
+  mondriaan_runtime_duplicate(context);
 
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK(stack.size() == 2);
   BOOST_CHECK(stack.top() == 1);
   stack.pop();
@@ -40,47 +57,62 @@ BOOST_FIXTURE_TEST_CASE(test_duplicate_value, TestFixture) {
 }
 
 BOOST_FIXTURE_TEST_CASE(test_duplicate_empty_stack, TestFixture) {
-  mondriaan_runtime_duplicate();
+  mondriaan_runtime_duplicate(context);
 
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK(stack.empty());
 }
 
 BOOST_FIXTURE_TEST_CASE(test_out_char, TestFixture) {
-  mondriaan_runtime_push((uint32_t)'a');
-  mondriaan_runtime_out_char();
+  mondriaan_runtime_push(context, (uint32_t)'a');
+  mondriaan_runtime_out_char(context);
 
   // TODO: figure out how to mock I/O.
 
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK(stack.empty());
 }
 
 BOOST_FIXTURE_TEST_CASE(test_out_char_empty_stack, TestFixture) {
-  mondriaan_runtime_out_char();
+  mondriaan_runtime_out_char(context);
 
   // TODO: figure out how to mock I/O.
 
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK(stack.empty());
 }
 
+BOOST_FIXTURE_TEST_CASE(test_switch, TestFixture) {
+  mondriaan_runtime_push(context, 2);
+  mondriaan_runtime_push(context, 3);
+
+  BOOST_CHECK_EQUAL(1, mondriaan_runtime_switch(context));
+  BOOST_CHECK_EQUAL(0, mondriaan_runtime_switch(context));
+
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK(stack.empty());
+}
+
+BOOST_FIXTURE_TEST_CASE(test_switch_empty_stack, TestFixture) {
+  BOOST_CHECK_EQUAL(0, mondriaan_runtime_switch(context));
+}
+
 BOOST_FIXTURE_TEST_CASE(test_roll_of_depth_1, TestFixture) {
   // Push values into stack: 1-5 in ascending order.
-  mondriaan_runtime_push(5);
-  mondriaan_runtime_push(4);
-  mondriaan_runtime_push(3);
-  mondriaan_runtime_push(2);
-  mondriaan_runtime_push(1);
+  mondriaan_runtime_push(context, 5);
+  mondriaan_runtime_push(context, 4);
+  mondriaan_runtime_push(context, 3);
+  mondriaan_runtime_push(context, 2);
+  mondriaan_runtime_push(context, 1);
 
   // Push the top value down by depth 4.
-  mondriaan_runtime_push(4); // depth
-  mondriaan_runtime_push(1); // rolls
+  mondriaan_runtime_push(context, 4); // depth
+  mondriaan_runtime_push(context, 1); // rolls
 
-  mondriaan_runtime_roll();
+  mondriaan_runtime_roll(context);
 
   // Confirm that the top value has been rolled.
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK_EQUAL(5, stack.size());
   std::array<uint32_t, 5> expected{2, 3, 4, 1, 5};
   for (uint32_t expectedIndex = 0; expectedIndex < 5; expectedIndex++) {
@@ -91,24 +123,249 @@ BOOST_FIXTURE_TEST_CASE(test_roll_of_depth_1, TestFixture) {
 
 BOOST_FIXTURE_TEST_CASE(test_roll_of_depth_2, TestFixture) {
   // Push values into stack: 1-5 in ascending order.
-  mondriaan_runtime_push(5);
-  mondriaan_runtime_push(4);
-  mondriaan_runtime_push(3);
-  mondriaan_runtime_push(2);
-  mondriaan_runtime_push(1);
+  mondriaan_runtime_push(context, 5);
+  mondriaan_runtime_push(context, 4);
+  mondriaan_runtime_push(context, 3);
+  mondriaan_runtime_push(context, 2);
+  mondriaan_runtime_push(context, 1);
 
   // Push the 2 top values down by depth 4.
-  mondriaan_runtime_push(4); // depth
-  mondriaan_runtime_push(2); // rolls
+  mondriaan_runtime_push(context, 4); // depth
+  mondriaan_runtime_push(context, 2); // rolls
 
-  mondriaan_runtime_roll();
+  mondriaan_runtime_roll(context);
 
   // Confirm that the 2 top values have been rolled.
-  auto stack = mondriaan_dump_stack();
+  auto stack = mondriaan_dump_stack(context);
   BOOST_CHECK_EQUAL(5, stack.size());
   std::array<uint32_t, 5> expected{3, 4, 1, 2, 5};
   for (uint32_t expectedIndex = 0; expectedIndex < 5; expectedIndex++) {
     BOOST_CHECK_EQUAL(expected[expectedIndex], stack.top());
     stack.pop();
   }
-}
\ No newline at end of file
+}
+
+BOOST_FIXTURE_TEST_CASE(test_roll_negative, TestFixture) {
+  // Push values into stack: 1-5 in ascending order.
+  mondriaan_runtime_push(context, 5);
+  mondriaan_runtime_push(context, 4);
+  mondriaan_runtime_push(context, 3);
+  mondriaan_runtime_push(context, 2);
+  mondriaan_runtime_push(context, 1);
+
+  // Bring the value at depth 4 up to the top, by a huge number of rolls.
+  mondriaan_runtime_push(context, 4);        // depth
+  mondriaan_runtime_push(context, -4000001); // rolls
+
+  mondriaan_runtime_roll(context);
+
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK_EQUAL(5, stack.size());
+  std::array<uint32_t, 5> expected{4, 1, 2, 3, 5};
+  for (uint32_t expectedIndex = 0; expectedIndex < 5; expectedIndex++) {
+    BOOST_CHECK_EQUAL(expected[expectedIndex], stack.top());
+    stack.pop();
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(test_roll_deeper_than_stack, TestFixture) {
+  mondriaan_runtime_push(context, 2);
+  mondriaan_runtime_push(context, 1);
+  mondriaan_runtime_push(context, 3); // depth
+  mondriaan_runtime_push(context, 1); // rolls
+
+  mondriaan_runtime_roll(context);
+
+  // The roll is skipped, but its arguments are popped.
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK_EQUAL(2, stack.size());
+  BOOST_CHECK_EQUAL(1, stack.top());
+}
+
+BOOST_FIXTURE_TEST_CASE(test_bignum_arithmetic, TestFixture) {
+  // 2^40 squared doesn't fit in a small integer, and divides back.
+  const int64_t number = (int64_t)1 << 40;
+  mondriaan_runtime_push(context, number);
+  mondriaan_runtime_duplicate(context);
+  mondriaan_runtime_multiply(context);
+  mondriaan_runtime_duplicate(context);
+  mondriaan_runtime_push(context, number);
+  mondriaan_runtime_divide(context);
+
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK_EQUAL(2, stack.size());
+  BOOST_CHECK_EQUAL(number, stack.top());
+
+  // The product stays a bignum until it's divided back into a small integer.
+  mondriaan_stack_pop(context);
+  auto product = mondriaan_stack_pop(context);
+  BOOST_CHECK(!mondriaan_value_is_small(product));
+  auto quotient = mondriaan_runtime_divide_values(
+      product, mondriaan_value_from_small(-number));
+  BOOST_CHECK(mondriaan_value_is_small(quotient));
+  BOOST_CHECK_EQUAL(-number, mondriaan_value_small(quotient));
+}
+
+BOOST_FIXTURE_TEST_CASE(test_independent_contexts, TestFixture) {
+  // A context of its own doesn't see the stack of the fixture.
+  auto other = mondriaan_context_create(STDIN_FILENO, STDOUT_FILENO);
+  mondriaan_runtime_push(context, 1);
+  mondriaan_runtime_push(other, 2);
+  mondriaan_runtime_push(other, 3);
+  mondriaan_runtime_multiply(other);
+
+  auto stack = mondriaan_dump_stack(context);
+  BOOST_CHECK_EQUAL(1, stack.size());
+  BOOST_CHECK_EQUAL(1, stack.top());
+  auto otherStack = mondriaan_dump_stack(other);
+  BOOST_CHECK_EQUAL(1, otherStack.size());
+  BOOST_CHECK_EQUAL(6, otherStack.top());
+  mondriaan_context_destroy(other);
+}
+
+static std::string readProfile(const boost::filesystem::path &filename) {
+  std::ifstream profile(filename.string());
+  return std::string((std::istreambuf_iterator<char>(profile)),
+                     std::istreambuf_iterator<char>());
+}
+
+BOOST_AUTO_TEST_CASE(test_write_profile) {
+  auto filename = boost::filesystem::temp_directory_path() /
+                  boost::filesystem::unique_path();
+  setenv("MONDRIAAN_PROFILE", filename.c_str(), 1);
+  std::ofstream(filename.string()) << "program other\npointer 5 5 5 5\n";
+
+  // The profile of another program is replaced.
+  std::array<uint64_t, 4> pointerCounters{3, 0, 1, 0};
+  std::array<uint64_t, 2> switchCounters{0, 7};
+  mondriaan_runtime_profile_program("0123abcd");
+  mondriaan_runtime_profile_site("pointer", pointerCounters.data(), 4);
+  mondriaan_runtime_profile_site("switch", switchCounters.data(), 2);
+  mondriaan_runtime_finish_profile();
+  BOOST_CHECK_EQUAL("program 0123abcd\npointer 3 0 1 0\nswitch 0 7\n",
+                    readProfile(filename));
+
+  // Another run of the same program adds its counts.
+  mondriaan_runtime_profile_program("0123abcd");
+  mondriaan_runtime_profile_site("pointer", pointerCounters.data(), 4);
+  mondriaan_runtime_profile_site("switch", switchCounters.data(), 2);
+  mondriaan_runtime_finish_profile();
+  BOOST_CHECK_EQUAL("program 0123abcd\npointer 6 0 2 0\nswitch 0 14\n",
+                    readProfile(filename));
+
+  // Nothing is left to write when the tests exit.
+  unsetenv("MONDRIAAN_PROFILE");
+  boost::filesystem::remove(filename);
+}
+
+BOOST_FIXTURE_TEST_CASE(test_write_stats, TestFixture) {
+  // multiply and out(char) are the 6th and the last operation of the table.
+  mondriaan_runtime_count(context, 5, 0);
+  mondriaan_runtime_count(context, 5, 0);
+  mondriaan_runtime_count(context, 17, 0);
+
+  auto filename = boost::filesystem::temp_directory_path() /
+                  boost::filesystem::unique_path();
+  BOOST_CHECK(mondriaan_runtime_write_stats(context, filename.c_str()));
+
+  std::ifstream json(filename.string());
+  std::string stats((std::istreambuf_iterator<char>(json)),
+                    std::istreambuf_iterator<char>());
+  BOOST_CHECK(stats.find("\"multiply\": 2,") != std::string::npos);
+  BOOST_CHECK(stats.find("\"out(char)\": 1\n") != std::string::npos);
+  BOOST_CHECK(stats.find("\"max_stack_depth\": ") != std::string::npos);
+  boost::filesystem::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(test_read_input) {
+  auto filename = boost::filesystem::temp_directory_path() /
+                  boost::filesystem::unique_path();
+  {
+    std::ofstream input(filename.string());
+    input << "  42\n-1 x\xc3\xa9";
+  }
+  int input = open(filename.c_str(), O_RDONLY);
+  BOOST_REQUIRE(input >= 0);
+  auto context = mondriaan_context_create(input, STDOUT_FILENO);
+
+  mondriaan_value value = 0;
+  BOOST_CHECK(mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK_EQUAL(42, mondriaan_value_small(value));
+  BOOST_CHECK(mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK_EQUAL(-1, mondriaan_value_small(value));
+
+  // Input that isn't a number is left for in(char).
+  BOOST_CHECK(!mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK(mondriaan_runtime_read_char(context, &value));
+  BOOST_CHECK_EQUAL('x', mondriaan_value_small(value));
+  BOOST_CHECK(mondriaan_runtime_read_char(context, &value));
+  BOOST_CHECK_EQUAL(0xE9, mondriaan_value_small(value));
+
+  BOOST_CHECK(!mondriaan_runtime_read_char(context, &value));
+  BOOST_CHECK(!mondriaan_runtime_read_number(context, &value));
+  mondriaan_context_destroy(context);
+  close(input);
+  boost::filesystem::remove(filename);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_read_chars) {
+  int input[2], output[2];
+  BOOST_REQUIRE(pipe(input) == 0 && pipe(output) == 0);
+  std::string text = "a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80-";
+  BOOST_REQUIRE(write(input[1], text.data(), text.size()) ==
+                (ssize_t)text.size());
+  close(input[1]);
+  auto context = mondriaan_context_create(input[0], output[1]);
+
+  // Characters read by in(char) are written back as the same UTF-8.
+  mondriaan_value value = 0;
+  for (int character = 0; character < 4; character++) {
+    BOOST_CHECK(mondriaan_runtime_read_char(context, &value));
+    mondriaan_runtime_write_char(context, value);
+  }
+
+  // A sign without a digit after it is left for in(char).
+  BOOST_CHECK(!mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK(mondriaan_runtime_read_char(context, &value));
+  BOOST_CHECK_EQUAL('-', mondriaan_value_small(value));
+  mondriaan_runtime_write_char(context, value);
+
+  // A value that isn't a character is written as U+FFFD.
+  mondriaan_runtime_write_char(context, mondriaan_value_from_small(-1));
+  mondriaan_context_destroy(context);
+  close(output[1]);
+
+  char written[64];
+  auto length = read(output[0], written, sizeof(written));
+  BOOST_REQUIRE(length >= 0);
+  BOOST_CHECK_EQUAL(text + "\xef\xbf\xbd", std::string(written, length));
+  close(input[0]);
+  close(output[0]);
+}
+
+BOOST_AUTO_TEST_CASE(test_flush_before_input) {
+  int input[2], output[2];
+  BOOST_REQUIRE(pipe(input) == 0 && pipe(output) == 0);
+  BOOST_REQUIRE(write(input[1], "12 34 56", 8) == 8);
+  close(input[1]);
+  fcntl(output[0], F_SETFL, O_NONBLOCK);
+  auto context = mondriaan_context_create(input[0], output[1]);
+
+  // The second number is already buffered, but the output before it is still
+  // written before it's read.
+  mondriaan_value value = 0;
+  char written[8];
+  mondriaan_runtime_write_char(context, mondriaan_value_from_small('a'));
+  BOOST_CHECK(mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK_EQUAL(1, read(output[0], written, sizeof(written)));
+  mondriaan_runtime_write_char(context, mondriaan_value_from_small('b'));
+  BOOST_CHECK(mondriaan_runtime_read_number(context, &value));
+  BOOST_CHECK_EQUAL(34, mondriaan_value_small(value));
+  BOOST_CHECK_EQUAL(1, read(output[0], written, sizeof(written)));
+  BOOST_CHECK_EQUAL('b', written[0]);
+
+  mondriaan_context_destroy(context);
+  close(input[0]);
+  close(output[0]);
+  close(output[1]);
+}
@@ -2,9 +2,14 @@
 #include "include/cxxopts/cxxopts.hpp"
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <llvm/Pass.h>
+#include <llvm/Support/Timer.h>
+#include <llvm/Support/raw_ostream.h>
 #include <png.h>
 #include <stack>
+#include <string>
 #include <vector>
 
 using namespace std;
@@ -18,8 +23,25 @@ bool validate_options(const cxxopts::ParseResult &result) {
 
   // TODO: add more validation.
 
+  auto optimisationLevel = result["optimise"].as<std::string>();
+  if (optimisationLevel != "0" && optimisationLevel != "1" &&
+      optimisationLevel != "2" && optimisationLevel != "3" &&
+      optimisationLevel != "s") {
+    cout << "Please specify an optimisation level of 0, 1, 2, 3 or s." << endl;
+    valid = false;
+  }
+
+  if (result["jobs"].as<unsigned>() == 0) {
+    cout << "Please specify at least 1 job." << endl;
+    valid = false;
+  }
+
   switch (result["output-file"].count()) {
   case 0:
+    if (result["run"].count() > 0) {
+      // Running a program doesn't create any files.
+      break;
+    }
     cout << "Please specify an output file." << endl;
     valid = false;
     break;
@@ -33,15 +55,96 @@ bool validate_options(const cxxopts::ParseResult &result) {
   return valid;
 }
 
-void compile(std::string inputFile, std::string outputFile, bool outputIR,
-             uint32_t codelSize) {
-  Piet::Parse::Reader reader;
+/**
+ * @brief Rewrite compiler style options such as -O2 and -j4 into --optimise=2
+ * and --jobs=4, as cxxopts doesn't accept values attached to short options.
+ */
+std::vector<std::string> normalise_arguments(int argc, char **argv) {
+  std::vector<std::string> arguments(argv, argv + argc);
+  for (auto &argument : arguments) {
+    if (argument.size() > 2 && argument.compare(0, 2, "-O") == 0) {
+      argument = "--optimise=" + argument.substr(2);
+    } else if (argument.size() > 2 && argument.compare(0, 2, "-j") == 0) {
+      argument = "--jobs=" + argument.substr(2);
+    }
+  }
+
+  return arguments;
+}
+
+Piet::Translator *translate(Piet::Parse::Image *image,
+                            Piet::TranslatorOptions translatorOptions) {
+  // A profile names the program it was recorded with.
+  if (translatorOptions.instrument || !translatorOptions.profileUse.empty()) {
+    translatorOptions.programHash = Piet::CompileCache::programHash(image);
+  }
 
-  auto image = reader.readFromFile(std::move(inputFile), codelSize);
   auto parser = new Piet::Parse::Parser(image);
   auto graph = parser->parse();
-  auto translator = new Piet::Translator(graph);
+  return new Piet::Translator(graph, translatorOptions);
+}
+
+void compile(std::string inputFile, std::string outputFile, bool outputIR,
+             uint32_t codelSize, Piet::TranslatorOptions translatorOptions,
+             std::string cacheDirectory) {
+  Piet::TimeReport::Phase decode("decode");
+  Piet::Parse::Reader reader;
+  auto image = reader.readFromFile(std::move(inputFile), codelSize);
+  decode.end();
+
+  // A cached output file only costs hashing the codels and copying the file.
+  Piet::CompileCache *cache = nullptr;
+  std::string cacheKey;
+  auto outputFilename = Piet::Translator::outputFilename(outputFile, outputIR,
+                                                         translatorOptions);
+  if (!cacheDirectory.empty()) {
+    Piet::TimeReport::Phase caching("cache");
+    cache = new Piet::CompileCache(cacheDirectory);
+    cacheKey = cache->key(image, translatorOptions, outputIR);
+    if (cache->restore(cacheKey, outputFilename)) {
+      cout << "Created " << outputFilename << " (cached)" << endl;
+      return;
+    }
+  }
+
+  auto translator = translate(image, translatorOptions);
   translator->translateToExecutable(std::move(outputFile), outputIR);
+
+  if (cache != nullptr) {
+    Piet::TimeReport::Phase caching("cache");
+    cache->store(cacheKey, outputFilename);
+  }
+}
+
+int run(std::string inputFile, uint32_t codelSize,
+        Piet::TranslatorOptions translatorOptions) {
+  Piet::TimeReport::Phase decode("decode");
+  Piet::Parse::Reader reader;
+  auto image = reader.readFromFile(std::move(inputFile), codelSize);
+  decode.end();
+
+  auto translator = translate(image, translatorOptions);
+  return translator->run();
+}
+
+/**
+ * @brief Print the time taken by LLVM's passes and by each phase of Mondriaan,
+ * if --time-report is given.
+ */
+void print_time_report() {
+  if (Piet::TimeReport::isEnabled()) {
+    llvm::TimerGroup::printAll(llvm::errs());
+    Piet::TimeReport::print(llvm::errs());
+  }
+}
+
+/**
+ * @brief Write the trace of the compilation, if --trace is given.
+ */
+void write_trace(const std::string &traceFile) {
+  if (Piet::Trace::isEnabled() && !Piet::Trace::write(traceFile)) {
+    exit(1);
+  }
 }
 
 int main(int argc, char **argv) {
@@ -56,10 +159,67 @@ int main(int argc, char **argv) {
         "input-file", "The Piet file to compile.",
         cxxopts::value<std::vector<std::string>>())(
         "s,codel-size", "Number of pixels per codel.",
-        cxxopts::value(codelSize)->default_value("1"));
+        cxxopts::value(codelSize)->default_value("1"))(
+        "single-function",
+        "Generate the program as a single function instead of a function per "
+        "branch.")(
+        "inline-stack",
+        "Generate the stack operations as inline LLVM IR instead of runtime "
+        "library calls.")(
+        "O,optimise", "Optimisation level: 0, 1, 2, 3 or s (for size).",
+        cxxopts::value<std::string>()->default_value("2"))(
+        "mcpu", "CPU to generate code for, or native for the host CPU.",
+        cxxopts::value<std::string>()->default_value("generic"))(
+        "mattr",
+        "Comma separated CPU features to enable (+feature) or disable "
+        "(-feature).",
+        cxxopts::value<std::string>()->default_value(""))(
+        "e,executable",
+        "Link the output file into an executable with the runtime library, "
+        "instead of creating an object file.")(
+        "lto",
+        "Link the runtime library into the program before optimising it, so "
+        "runtime calls can be inlined.")(
+        "run",
+        "Run the program in-process with the JIT compiler instead of creating "
+        "an output file.")(
+        "j,jobs", "Number of threads translating and generating machine code.",
+        cxxopts::value<unsigned>()->default_value("1"))(
+        "instrument",
+        "Count the outcomes of every pointer/switch instruction, and write "
+        "them to a profile when the program exits: $MONDRIAAN_PROFILE, or "
+        "mondriaan.profile.")(
+        "profile-use",
+        "Order and weight the dispatch of pointer/switch instructions by the "
+        "profile written by an instrumented program.",
+        cxxopts::value<std::string>()->default_value(""))(
+        "g,debug-info",
+        "Emit DWARF line info locating the generated code at the codel blocks "
+        "of the image: the line is the row, the column the column.")(
+        "perf-map",
+        "With --run, write the compiled functions to /tmp/perf-<pid>.map for "
+        "perf.")(
+        "time-report",
+        "Print the wall time, CPU time and peak memory growth of each phase "
+        "of the compilation, and the time taken by each LLVM pass.")(
+        "trace",
+        "Write a Chrome trace event file of the compilation, for "
+        "chrome://tracing or Perfetto, with a track for each thread.",
+        cxxopts::value<std::string>()->default_value(""))(
+        "cache-dir",
+        "Directory to cache output files in, shared by concurrent "
+        "compilations. Defaults to $MONDRIAAN_CACHE_DIR, if set.",
+        cxxopts::value<std::string>()->default_value(""));
     options.parse_positional({"input-file"});
     options.positional_help("input-file");
-    auto result = options.parse(argc, argv);
+    auto arguments = normalise_arguments(argc, argv);
+    std::vector<char *> argumentPointers;
+    for (auto &argument : arguments) {
+      argumentPointers.push_back(&argument[0]);
+    }
+    int argumentCount = (int)argumentPointers.size();
+    char **argumentValues = argumentPointers.data();
+    auto result = options.parse(argumentCount, argumentValues);
 
     if (result["help"].as<bool>()) {
       print_help(options);
@@ -71,10 +231,54 @@ int main(int argc, char **argv) {
     }
 
     bool outputIR = result["emit-llvm"].count() > 0;
-    auto outputFile = result["output-file"].as<std::string>();
     auto inputFile = result["input-file"].as<std::vector<std::string>>()[0];
 
-    compile(inputFile, outputFile, outputIR, codelSize);
+    Piet::TranslatorOptions translatorOptions;
+    translatorOptions.singleFunction = result["single-function"].count() > 0;
+    translatorOptions.inlineStack = result["inline-stack"].count() > 0;
+    auto optimisationLevel = result["optimise"].as<std::string>();
+    translatorOptions.optimiseForSize = optimisationLevel == "s";
+    translatorOptions.optimisationLevel =
+        translatorOptions.optimiseForSize ? 2 : std::stoul(optimisationLevel);
+    translatorOptions.cpu = result["mcpu"].as<std::string>();
+    translatorOptions.features = result["mattr"].as<std::string>();
+    translatorOptions.link = result["executable"].count() > 0;
+    translatorOptions.linkRuntime = result["lto"].count() > 0;
+    translatorOptions.jobs = result["jobs"].as<unsigned>();
+    translatorOptions.instrument = result["instrument"].count() > 0;
+    translatorOptions.profileUse = result["profile-use"].as<std::string>();
+    translatorOptions.debugInfo = result["debug-info"].count() > 0;
+    translatorOptions.sourceFilename = inputFile;
+    translatorOptions.perfMap = result["perf-map"].count() > 0;
+
+    if (result["time-report"].count() > 0) {
+      Piet::TimeReport::enable();
+      // LLVM's pass timers can't be shared by the threads of -j.
+      llvm::TimePassesIsEnabled = translatorOptions.jobs <= 1;
+    }
+
+    auto traceFile = result["trace"].as<std::string>();
+    if (!traceFile.empty()) {
+      Piet::Trace::enable();
+    }
+
+    if (result["run"].count() > 0) {
+      int exitCode = run(inputFile, codelSize, translatorOptions);
+      print_time_report();
+      write_trace(traceFile);
+      return exitCode;
+    }
+
+    auto cacheDirectory = result["cache-dir"].as<std::string>();
+    if (cacheDirectory.empty() && getenv("MONDRIAAN_CACHE_DIR") != nullptr) {
+      cacheDirectory = getenv("MONDRIAAN_CACHE_DIR");
+    }
+
+    auto outputFile = result["output-file"].as<std::string>();
+    compile(inputFile, outputFile, outputIR, codelSize, translatorOptions,
+            cacheDirectory);
+    print_time_report();
+    write_trace(traceFile);
   } catch (cxxopts::OptionParseException &parseExc) {
     cout << parseExc.what() << endl;
     return 1;
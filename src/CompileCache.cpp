@@ -0,0 +1,165 @@
+#include "../include/Piet.h"
+#include "../lib/include/Runtime.h"
+#include "BuildID.inc"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <map>
+
+using namespace llvm;
+
+namespace Piet {
+string CompileCache::key(Parse::Image *image, const TranslatorOptions &options,
+                         bool onlyIR) {
+  SHA1 hash;
+
+  // Each field ends with a newline, so that fields can't run into each other.
+  string fields;
+  raw_string_ostream fieldStream(fields);
+  fieldStream << "mondriaan " << MONDRIAAN_VERSION << "\n"
+              << "build " << MONDRIAAN_BUILD_ID << "\n"
+              << "runtime-abi " << MONDRIAAN_RUNTIME_ABI_VERSION << "\n"
+              << "llvm " << LLVM_VERSION_STRING << "\n"
+              << "target " << sys::getDefaultTargetTriple() << "\n";
+
+  // The host CPU has to be part of the key, or hosts would share objects
+  // compiled for each other's CPUs.
+  if (options.cpu == "native") {
+    fieldStream << "cpu " << sys::getHostCPUName() << "\n";
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures)) {
+      std::map<string, bool> sortedFeatures;
+      for (auto &hostFeature : hostFeatures) {
+        sortedFeatures[hostFeature.first().str()] = hostFeature.second;
+      }
+      for (auto &hostFeature : sortedFeatures) {
+        fieldStream << (hostFeature.second ? "+" : "-") << hostFeature.first
+                    << ",";
+      }
+      fieldStream << "\n";
+    }
+  } else {
+    fieldStream << "cpu " << options.cpu << "\n";
+  }
+
+  fieldStream << "features " << options.features << "\n"
+              << "optimise " << options.optimisationLevel
+              << (options.optimiseForSize ? "s" : "") << "\n"
+              << "single-function " << options.singleFunction << "\n"
+              << "inline-stack " << options.inlineStack << "\n"
+              << "lto " << options.linkRuntime << "\n"
+              << "executable " << options.link << "\n"
+              << "emit-llvm " << onlyIR << "\n"
+              << "instrument " << options.instrument << "\n"
+              << "codels " << image->getRows() << "x" << image->getColumns()
+              << "\n";
+  // Debug info names the image by its absolute path.
+  if (options.debugInfo) {
+    SmallString<128> sourceFilename(options.sourceFilename);
+    sys::fs::make_absolute(sourceFilename);
+    fieldStream << "debug-info " << sourceFilename << "\n";
+  }
+  fieldStream.flush();
+  hash.update(fields);
+
+  // The profile decides the order and weights of dispatches.
+  if (!options.profileUse.empty()) {
+    auto profile = MemoryBuffer::getFile(options.profileUse);
+    if (profile) {
+      hash.update((*profile)->getBuffer());
+    }
+  }
+
+  // With --lto, the program contains the runtime bitcode embedded in
+  // Mondriaan.
+  if (options.linkRuntime) {
+    hash.update(Translator::runtimeBitcode());
+  }
+
+  // An executable contains the runtime library too.
+  if (options.link) {
+    auto runtime = MemoryBuffer::getFile(Linker().getRuntimeArchive());
+    if (runtime) {
+      hash.update((*runtime)->getBuffer());
+    }
+  }
+
+  hash.update(programHash(image));
+  return toHex(hash.result(), true);
+}
+
+string CompileCache::programHash(Parse::Image *image) {
+  SHA1 hash;
+  vector<uint8_t> rowBytes;
+  for (uint32_t row = 0; row < image->getRows(); row++) {
+    rowBytes.clear();
+    for (uint32_t column = 0; column < image->getColumns(); column++) {
+      uint32_t color = image->at({row, column});
+      rowBytes.insert(rowBytes.end(), {(uint8_t)(color >> 16),
+                                       (uint8_t)(color >> 8), (uint8_t)color});
+    }
+    hash.update(rowBytes);
+  }
+
+  return toHex(hash.result(), true);
+}
+
+string CompileCache::entryFilename(const string &key) {
+  SmallString<128> filename(directory);
+  sys::path::append(filename, key);
+  return filename.str().str();
+}
+
+bool CompileCache::restore(const string &key, const string &outputFilename) {
+  auto entry = entryFilename(key);
+  sys::fs::file_status entryStatus;
+  if (sys::fs::status(entry, entryStatus) ||
+      !sys::fs::exists(entryStatus)) {
+    return false;
+  }
+
+  if (sys::fs::copy_file(entry, outputFilename)) {
+    return false;
+  }
+  sys::fs::setPermissions(outputFilename, entryStatus.permissions());
+  return true;
+}
+
+void CompileCache::store(const string &key, const string &outputFilename) {
+  sys::fs::file_status outputStatus;
+  if (sys::fs::create_directories(directory) ||
+      sys::fs::status(outputFilename, outputStatus)) {
+    errs() << "Could not store " << outputFilename << " in the cache "
+           << directory << ".\n";
+    return;
+  }
+
+  // Readers never see a partially written entry: it's copied to a unique
+  // file first, then renamed to its key.
+  SmallString<128> temporaryFilename;
+  if (sys::fs::createUniqueFile(entryFilename(key) + "-%%%%%%%%.tmp",
+                                temporaryFilename)) {
+    errs() << "Could not store " << outputFilename << " in the cache "
+           << directory << ".\n";
+    return;
+  }
+
+  if (sys::fs::copy_file(outputFilename, temporaryFilename) ||
+      sys::fs::setPermissions(temporaryFilename,
+                              outputStatus.permissions()) ||
+      sys::fs::rename(temporaryFilename, entryFilename(key))) {
+    sys::fs::remove(temporaryFilename);
+    errs() << "Could not store " << outputFilename << " in the cache "
+           << directory << ".\n";
+  }
+}
+} // namespace Piet
@@ -23,4 +23,27 @@ DirectionPoint Piet::incrementDirectionPointer(DirectionPoint direction) {
   default:
     return TopRight;
   }
-};
\ No newline at end of file
+};
+
+DirectionPoint Piet::toggleCodelChooser(DirectionPoint direction) {
+  switch (direction) {
+  case TopLeft:
+    return TopRight;
+  case TopRight:
+    return TopLeft;
+  case RightTop:
+    return RightBottom;
+  case RightBottom:
+    return RightTop;
+  case BottomRight:
+    return BottomLeft;
+  case BottomLeft:
+    return BottomRight;
+  case LeftBottom:
+    return LeftTop;
+  case LeftTop:
+    return LeftBottom;
+  default:
+    return TopLeft;
+  }
+};
@@ -9,6 +9,8 @@ void GraphNode::markAsTerminal() { terminal = true; }
 
 string GraphNode::getIdentifier() { return identifier; }
 
+Position GraphNode::getPosition() { return position; }
+
 GraphEdge *GraphNode::edgeForDirection(Piet::DirectionPoint direction) {
   auto edgeIterator = edges.find(direction);
   if (edgeIterator == edges.end()) {
@@ -38,6 +40,10 @@ GraphNode *Graph::getInitialNode() { return initialNode; }
 
 GraphNode *Graph::getCurrentNode() { return currentNode; }
 
+GraphState Graph::getCurrentState() {
+  return GraphState{currentNode, currentDirection};
+}
+
 void Graph::restartWalk(GraphNode *fromNode, DirectionPoint inDirection) {
   currentNode = fromNode;
   currentDirection = inDirection;
@@ -23,4 +23,8 @@ uint32_t Image::ownerAt(Position position) {
 bool Image::in(Position position) {
   return position.row < rows && position.column < columns;
 }
+
+uint32_t Image::getRows() { return rows; }
+
+uint32_t Image::getColumns() { return columns; }
 } // namespace Piet::Parse
@@ -0,0 +1,452 @@
+#include "../include/Piet.h"
+
+#include <llvm/IR/BasicBlock.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Type.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <iostream>
+#include <limits>
+
+using namespace std;
+using namespace llvm;
+
+namespace Piet {
+StructType *runtimeContextType(LLVMContext &context) {
+  // struct mondriaan_context {
+  //   struct mondriaan_stack { values, size, capacity } stack;
+  //   struct mondriaan_context_state *state;
+  // }
+  Type *int64Ty = Type::getInt64Ty(context);
+  StructType *stackType = StructType::get(
+      context, {Type::getInt64PtrTy(context), int64Ty, int64Ty});
+  return StructType::get(context, {stackType, Type::getInt8PtrTy(context)});
+}
+
+Value *runtimeContext(IRBuilder<> &builder) {
+  return &*builder.GetInsertBlock()->getParent()->arg_begin();
+}
+
+void InlineStack::registerGlobals(Function *writeCharFunction,
+                                  Function *writeNumberFunction,
+                                  Function *readNumberFunction,
+                                  Function *readCharFunction) {
+  Type *int8Ty = Type::getInt8Ty(context);
+  Type *int64Ty = Type::getInt64Ty(context);
+  PointerType *contextPtrTy = runtimeContextType(context)->getPointerTo();
+
+  // Register reserve.
+  FunctionType *reserveType = FunctionType::get(
+      Type::getVoidTy(context), {contextPtrTy, int64Ty}, false);
+  reserve = Function::Create(reserveType, Function::ExternalLinkage,
+                             "mondriaan_runtime_reserve", &module);
+
+  // Register the bignum arithmetic.
+  FunctionType *binaryType =
+      FunctionType::get(int64Ty, {int64Ty, int64Ty}, false);
+  multiplyValues = Function::Create(binaryType, Function::ExternalLinkage,
+                                    "mondriaan_runtime_multiply_values",
+                                    &module);
+  divideValues = Function::Create(binaryType, Function::ExternalLinkage,
+                                  "mondriaan_runtime_divide_values", &module);
+  FunctionType *selectorType =
+      FunctionType::get(int8Ty, {int64Ty, int8Ty}, false);
+  selector = Function::Create(selectorType, Function::ExternalLinkage,
+                              "mondriaan_runtime_selector", &module);
+  FunctionType *rollShiftType =
+      FunctionType::get(int64Ty, {int64Ty, int64Ty}, false);
+  rollShift = Function::Create(rollShiftType, Function::ExternalLinkage,
+                               "mondriaan_runtime_roll_shift", &module);
+  FunctionType *copyType = FunctionType::get(int64Ty, {int64Ty}, false);
+  copy = Function::Create(copyType, Function::ExternalLinkage,
+                          "mondriaan_runtime_copy", &module);
+  FunctionType *releaseType =
+      FunctionType::get(Type::getVoidTy(context), {int64Ty}, false);
+  release = Function::Create(releaseType, Function::ExternalLinkage,
+                             "mondriaan_runtime_release", &module);
+
+  writeChar = writeCharFunction;
+  writeNumber = writeNumberFunction;
+  readNumber = readNumberFunction;
+  readChar = readCharFunction;
+
+  defineRoll();
+}
+
+Value *InlineStack::stackField(StackField field) {
+  Value *indices[] = {builder.getInt32(0), builder.getInt32(0),
+                      builder.getInt32(field)};
+  return builder.CreateInBoundsGEP(runtimeContextType(context),
+                                   runtimeContext(builder), indices);
+}
+
+Value *InlineStack::loadSize() {
+  return builder.CreateLoad(Type::getInt64Ty(context), stackField(SIZE),
+                            "size");
+}
+
+Value *InlineStack::loadBase() {
+  return builder.CreateLoad(Type::getInt64PtrTy(context), stackField(VALUES),
+                            "base");
+}
+
+Value *InlineStack::slot(Value *size, uint64_t depth) {
+  Value *base = loadBase();
+  Value *index = builder.CreateSub(size, builder.getInt64(depth + 1));
+  return builder.CreateInBoundsGEP(Type::getInt64Ty(context), base, index);
+}
+
+Value *InlineStack::isSmall(Value *value) {
+  return builder.CreateICmpEQ(builder.CreateAnd(value, builder.getInt64(1)),
+                              builder.getInt64(0), "small");
+}
+
+BasicBlock *InlineStack::createBlock(const string &name) {
+  return BasicBlock::Create(context, name,
+                            builder.GetInsertBlock()->getParent());
+}
+
+BasicBlock *InlineStack::guardDepth(uint64_t depth) {
+  Function *openFunction = builder.GetInsertBlock()->getParent();
+  BasicBlock *operationBlock =
+      BasicBlock::Create(context, "mondriaan.stack.op", openFunction);
+  BasicBlock *continueBlock =
+      BasicBlock::Create(context, "mondriaan.stack.cont", openFunction);
+
+  Value *hasDepth = builder.CreateICmpUGE(loadSize(), builder.getInt64(depth));
+  builder.CreateCondBr(hasDepth, operationBlock, continueBlock);
+  builder.SetInsertPoint(operationBlock);
+  return continueBlock;
+}
+
+void InlineStack::push(Value *value) {
+  Function *openFunction = builder.GetInsertBlock()->getParent();
+  BasicBlock *growBlock =
+      BasicBlock::Create(context, "mondriaan.stack.grow", openFunction);
+  BasicBlock *pushBlock =
+      BasicBlock::Create(context, "mondriaan.stack.push", openFunction);
+
+  /**
+   *  %full = icmp uge i64 %size, %capacity
+   *  br i1 %full, label %mondriaan.stack.grow, label %mondriaan.stack.push
+   *
+   * mondriaan.stack.grow:
+   *  call mondriaan_runtime_reserve(%context, %size + 1)
+   *  br label %mondriaan.stack.push
+   *
+   * mondriaan.stack.push:
+   *  store %value at %base[%size], store %size + 1
+   */
+  Value *size = loadSize();
+  Value *capacity = builder.CreateLoad(Type::getInt64Ty(context),
+                                       stackField(CAPACITY), "capacity");
+  builder.CreateCondBr(builder.CreateICmpUGE(size, capacity), growBlock,
+                       pushBlock);
+
+  builder.SetInsertPoint(growBlock);
+  Value *grownSize = builder.CreateAdd(size, builder.getInt64(1));
+  builder.CreateCall(reserve, {runtimeContext(builder), grownSize});
+  builder.CreateBr(pushBlock);
+
+  builder.SetInsertPoint(pushBlock);
+  builder.CreateStore(value, builder.CreateInBoundsGEP(
+                                 Type::getInt64Ty(context), loadBase(), size));
+  builder.CreateStore(builder.CreateAdd(size, builder.getInt64(1)),
+                      stackField(SIZE));
+}
+
+Value *InlineStack::popSelector(uint8_t branches) {
+  BasicBlock *emptyBlock = builder.GetInsertBlock();
+  BasicBlock *continueBlock = guardDepth(1);
+  BasicBlock *popBlock = builder.GetInsertBlock();
+
+  Value *size = loadSize();
+  Value *top = builder.CreateLoad(Type::getInt64Ty(context), slot(size, 0));
+  builder.CreateStore(builder.CreateSub(size, builder.getInt64(1)),
+                      stackField(SIZE));
+  // The lowest bits of the two's complement of a small integer are its value
+  // modulo branches. A bignum is left to the runtime library.
+  Value *smallBranch = builder.CreateTrunc(
+      builder.CreateAnd(builder.CreateAShr(top, 1),
+                        builder.getInt64(branches - 1)),
+      Type::getInt8Ty(context));
+  BasicBlock *bignumBlock = createBlock("mondriaan.stack.bignum");
+  builder.CreateCondBr(isSmall(top), continueBlock, bignumBlock);
+
+  builder.SetInsertPoint(bignumBlock);
+  Value *bignumBranch =
+      builder.CreateCall(selector, {top, builder.getInt8(branches)});
+  builder.CreateBr(continueBlock);
+
+  builder.SetInsertPoint(continueBlock);
+  PHINode *branch = builder.CreatePHI(Type::getInt8Ty(context), 3,
+                                      "selector");
+  branch->addIncoming(builder.getInt8(0), emptyBlock);
+  branch->addIncoming(smallBranch, popBlock);
+  branch->addIncoming(bignumBranch, bignumBlock);
+  return branch;
+}
+
+void InlineStack::defineRoll() {
+  Type *int64Ty = Type::getInt64Ty(context);
+  PointerType *int64PtrTy = Type::getInt64PtrTy(context);
+
+  // Reverse the values from index first up to and including index last.
+  Function *reverse = Function::Create(
+      FunctionType::get(Type::getVoidTy(context),
+                        {int64PtrTy, int64Ty, int64Ty}, false),
+      Function::PrivateLinkage, "mondriaan.stack.reverse", &module);
+  {
+    Function::arg_iterator args = reverse->arg_begin();
+    Value *base = &args[0], *first = &args[1], *last = &args[2];
+    BasicBlock *entryBlock = BasicBlock::Create(context, "entry", reverse);
+    BasicBlock *testBlock = BasicBlock::Create(context, "test", reverse);
+    BasicBlock *swapBlock = BasicBlock::Create(context, "swap", reverse);
+    BasicBlock *exitBlock = BasicBlock::Create(context, "exit", reverse);
+
+    builder.SetInsertPoint(entryBlock);
+    builder.CreateBr(testBlock);
+
+    builder.SetInsertPoint(testBlock);
+    PHINode *low = builder.CreatePHI(int64Ty, 2, "low");
+    PHINode *high = builder.CreatePHI(int64Ty, 2, "high");
+    builder.CreateCondBr(builder.CreateICmpULT(low, high), swapBlock,
+                         exitBlock);
+
+    builder.SetInsertPoint(swapBlock);
+    Value *lowSlot = builder.CreateInBoundsGEP(int64Ty, base, low);
+    Value *highSlot = builder.CreateInBoundsGEP(int64Ty, base, high);
+    Value *lowValue = builder.CreateLoad(int64Ty, lowSlot);
+    Value *highValue = builder.CreateLoad(int64Ty, highSlot);
+    builder.CreateStore(highValue, lowSlot);
+    builder.CreateStore(lowValue, highSlot);
+    Value *nextLow = builder.CreateAdd(low, builder.getInt64(1));
+    Value *nextHigh = builder.CreateSub(high, builder.getInt64(1));
+    builder.CreateBr(testBlock);
+
+    low->addIncoming(first, entryBlock);
+    low->addIncoming(nextLow, swapBlock);
+    high->addIncoming(last, entryBlock);
+    high->addIncoming(nextHigh, swapBlock);
+
+    builder.SetInsertPoint(exitBlock);
+    builder.CreateRetVoid();
+  }
+
+  // Pop the number of rolls and the depth, then rotate the values above the
+  // depth with 3 reversals.
+  roll = Function::Create(
+      FunctionType::get(Type::getVoidTy(context),
+                        {runtimeContextType(context)->getPointerTo()}, false),
+      Function::PrivateLinkage, "mondriaan.stack.roll", &module);
+  {
+    BasicBlock *entryBlock = BasicBlock::Create(context, "entry", roll);
+    BasicBlock *popBlock = BasicBlock::Create(context, "pop", roll);
+    BasicBlock *releaseBlock = BasicBlock::Create(context, "release", roll);
+    BasicBlock *shiftBlock = BasicBlock::Create(context, "shift", roll);
+    BasicBlock *smallShiftBlock =
+        BasicBlock::Create(context, "shift.small", roll);
+    BasicBlock *bignumShiftBlock =
+        BasicBlock::Create(context, "shift.bignum", roll);
+    BasicBlock *rotateBlock = BasicBlock::Create(context, "rotate", roll);
+    BasicBlock *reverseBlock = BasicBlock::Create(context, "reverse", roll);
+    BasicBlock *exitBlock = BasicBlock::Create(context, "exit", roll);
+
+    builder.SetInsertPoint(entryBlock);
+    Value *size = loadSize();
+    builder.CreateCondBr(builder.CreateICmpUGE(size, builder.getInt64(3)),
+                         popBlock, exitBlock);
+
+    builder.SetInsertPoint(popBlock);
+    Value *rolls = builder.CreateLoad(int64Ty, slot(size, 0), "rolls");
+    Value *taggedDepth = builder.CreateLoad(int64Ty, slot(size, 1));
+    Value *rollSize = builder.CreateSub(size, builder.getInt64(2));
+    builder.CreateStore(rollSize, stackField(SIZE));
+    // A bignum depth is deeper than any stack.
+    Value *depth = builder.CreateAShr(taggedDepth, 1, "depth");
+    Value *validDepth = builder.CreateAnd(
+        isSmall(taggedDepth),
+        builder.CreateAnd(builder.CreateICmpSGT(depth, builder.getInt64(0)),
+                          builder.CreateICmpULE(depth, rollSize)));
+    builder.CreateCondBr(validDepth, shiftBlock, releaseBlock);
+
+    builder.SetInsertPoint(releaseBlock);
+    builder.CreateCall(release, {rolls});
+    builder.CreateCall(release, {taggedDepth});
+    builder.CreateBr(exitBlock);
+
+    builder.SetInsertPoint(shiftBlock);
+    builder.CreateCondBr(isSmall(rolls), smallShiftBlock, bignumShiftBlock);
+
+    builder.SetInsertPoint(smallShiftBlock);
+    // A negative number of rolls rotates the other way.
+    Value *remainder = builder.CreateSRem(builder.CreateAShr(rolls, 1), depth);
+    Value *smallShift = builder.CreateSelect(
+        builder.CreateICmpSLT(remainder, builder.getInt64(0)),
+        builder.CreateAdd(remainder, depth), remainder);
+    builder.CreateBr(rotateBlock);
+
+    builder.SetInsertPoint(bignumShiftBlock);
+    Value *bignumShift = builder.CreateCall(rollShift, {rolls, depth});
+    builder.CreateBr(rotateBlock);
+
+    builder.SetInsertPoint(rotateBlock);
+    PHINode *shift = builder.CreatePHI(int64Ty, 2, "shift");
+    shift->addIncoming(smallShift, smallShiftBlock);
+    shift->addIncoming(bignumShift, bignumShiftBlock);
+    builder.CreateCondBr(builder.CreateICmpNE(shift, builder.getInt64(0)),
+                         reverseBlock, exitBlock);
+
+    builder.SetInsertPoint(reverseBlock);
+    Value *base = loadBase();
+    Value *first = builder.CreateSub(rollSize, depth);
+    Value *last = builder.CreateSub(rollSize, builder.getInt64(1));
+    Value *split = builder.CreateAdd(first, shift);
+    builder.CreateCall(reverse, {base, first, last});
+    builder.CreateCall(reverse,
+                       {base, first, builder.CreateSub(split,
+                                                       builder.getInt64(1))});
+    builder.CreateCall(reverse, {base, split, last});
+    builder.CreateBr(exitBlock);
+
+    builder.SetInsertPoint(exitBlock);
+    builder.CreateRetVoid();
+  }
+
+  if (verifyFunction(*reverse, &errs()) || verifyFunction(*roll, &errs())) {
+    exit(1);
+  }
+}
+
+void InlineStack::translateOperation(const OpKeyType &operation,
+                                     Parse::GraphStep *step) {
+  Type *int64Ty = Type::getInt64Ty(context);
+
+  if (operation == OP_PUSH) {
+    push(builder.getInt64(step->previous->getSize() << 1));
+  } else if (operation == OP_OUT_CHAR || operation == OP_OUT_NUMBER) {
+    BasicBlock *continueBlock = guardDepth(1);
+    Value *size = loadSize();
+    Value *top = builder.CreateLoad(int64Ty, slot(size, 0));
+    builder.CreateStore(builder.CreateSub(size, builder.getInt64(1)),
+                        stackField(SIZE));
+    builder.CreateCall(operation == OP_OUT_CHAR ? writeChar : writeNumber,
+                       {runtimeContext(builder), top});
+    builder.CreateBr(continueBlock);
+    builder.SetInsertPoint(continueBlock);
+  } else if (operation == OP_DUPLICATE) {
+    BasicBlock *continueBlock = guardDepth(1);
+    BasicBlock *topBlock = builder.GetInsertBlock();
+    BasicBlock *copyBlock = createBlock("mondriaan.stack.copy");
+    BasicBlock *pushBlock = createBlock("mondriaan.stack.dup");
+
+    // A bignum is copied, as each slot owns its bignum.
+    Value *top = builder.CreateLoad(int64Ty, slot(loadSize(), 0));
+    builder.CreateCondBr(isSmall(top), pushBlock, copyBlock);
+    builder.SetInsertPoint(copyBlock);
+    Value *copied = builder.CreateCall(copy, {top});
+    builder.CreateBr(pushBlock);
+
+    builder.SetInsertPoint(pushBlock);
+    PHINode *duplicated = builder.CreatePHI(int64Ty, 2);
+    duplicated->addIncoming(top, topBlock);
+    duplicated->addIncoming(copied, copyBlock);
+    push(duplicated);
+    builder.CreateBr(continueBlock);
+    builder.SetInsertPoint(continueBlock);
+  } else if (operation == OP_IN_NUMBER || operation == OP_IN_CHAR) {
+    Function *openFunction = builder.GetInsertBlock()->getParent();
+    BasicBlock *readBlock = createBlock("mondriaan.stack.read");
+    BasicBlock *continueBlock = createBlock("mondriaan.stack.cont");
+
+    // The number is read into an alloca in the entry block, so that it is
+    // promoted to a register.
+    IRBuilder<> entryBuilder(&openFunction->getEntryBlock(),
+                             openFunction->getEntryBlock().begin());
+    Value *number = entryBuilder.CreateAlloca(int64Ty, nullptr, "number");
+    Value *read =
+        builder.CreateCall(operation == OP_IN_NUMBER ? readNumber : readChar,
+                           {runtimeContext(builder), number});
+    builder.CreateCondBr(read, readBlock, continueBlock);
+
+    builder.SetInsertPoint(readBlock);
+    push(builder.CreateLoad(int64Ty, number));
+    builder.CreateBr(continueBlock);
+    builder.SetInsertPoint(continueBlock);
+  } else if (operation == OP_MULTIPLY || operation == OP_DIVIDE) {
+    BasicBlock *continueBlock = guardDepth(2);
+    Value *size = loadSize();
+    Value *topSlot = slot(size, 0), *secondSlot = slot(size, 1);
+    Value *top = builder.CreateLoad(int64Ty, topSlot);
+    Value *second = builder.CreateLoad(int64Ty, secondSlot);
+
+    if (operation == OP_DIVIDE) {
+      // Division by zero is skipped instead of trapping.
+      BasicBlock *divideBlock = createBlock("mondriaan.stack.divide");
+      builder.CreateCondBr(builder.CreateICmpNE(top, builder.getInt64(0)),
+                           divideBlock, continueBlock);
+      builder.SetInsertPoint(divideBlock);
+    }
+
+    BasicBlock *smallBlock = createBlock("mondriaan.stack.small");
+    BasicBlock *bignumBlock = createBlock("mondriaan.stack.bignum");
+    BasicBlock *storeBlock = createBlock("mondriaan.stack.store");
+    Value *bothSmall = isSmall(builder.CreateOr(top, second));
+
+    // Small integers are computed inline. A result that doesn't fit in a
+    // small integer is left to the bignums of the runtime library.
+    Value *smallResult;
+    if (operation == OP_MULTIPLY) {
+      builder.CreateCondBr(bothSmall, smallBlock, bignumBlock);
+      builder.SetInsertPoint(smallBlock);
+      // A small integer times a tagged one is their tagged product.
+      Function *multiplyWithOverflow = Intrinsic::getDeclaration(
+          &module, Intrinsic::smul_with_overflow, {int64Ty});
+      Value *product = builder.CreateCall(multiplyWithOverflow,
+                                          {builder.CreateAShr(second, 1), top});
+      smallResult = builder.CreateExtractValue(product, 0);
+      builder.CreateCondBr(builder.CreateExtractValue(product, 1), bignumBlock,
+                           storeBlock);
+    } else {
+      // The quotient of two tagged integers is the quotient of the integers.
+      // Only the smallest integer divided by -1 overflows.
+      Value *smallest = builder.getInt64(numeric_limits<int64_t>::min());
+      Value *overflow =
+          builder.CreateAnd(builder.CreateICmpEQ(second, smallest),
+                            builder.CreateICmpEQ(top, builder.getInt64(-2)));
+      builder.CreateCondBr(
+          builder.CreateAnd(bothSmall, builder.CreateNot(overflow)), smallBlock,
+          bignumBlock);
+      builder.SetInsertPoint(smallBlock);
+      smallResult = builder.CreateShl(builder.CreateSDiv(second, top), 1);
+      builder.CreateBr(storeBlock);
+    }
+
+    builder.SetInsertPoint(bignumBlock);
+    Value *bignumResult = builder.CreateCall(
+        operation == OP_MULTIPLY ? multiplyValues : divideValues,
+        {second, top});
+    builder.CreateBr(storeBlock);
+
+    builder.SetInsertPoint(storeBlock);
+    PHINode *result = builder.CreatePHI(int64Ty, 2);
+    result->addIncoming(smallResult, smallBlock);
+    result->addIncoming(bignumResult, bignumBlock);
+    builder.CreateStore(result, secondSlot);
+    builder.CreateStore(builder.CreateSub(size, builder.getInt64(1)),
+                        stackField(SIZE));
+    builder.CreateBr(continueBlock);
+    builder.SetInsertPoint(continueBlock);
+  } else if (operation == OP_ROLL) {
+    builder.CreateCall(roll, {runtimeContext(builder)});
+  } else {
+    cout << "Yet unsupported operation: " << operation << endl;
+  }
+}
+} // namespace Piet
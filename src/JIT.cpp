@@ -0,0 +1,246 @@
+#include "../include/Piet.h"
+#include "../lib/include/Runtime.h"
+
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/ExecutionEngine/Orc/ExecutionUtils.h>
+#include <llvm/ExecutionEngine/Orc/IndirectionUtils.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/ExecutionEngine/Orc/LazyReexports.h>
+#include <llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h>
+#include <llvm/ExecutionEngine/SectionMemoryManager.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/Object/SymbolSize.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace llvm;
+
+namespace Piet {
+namespace {
+/**
+ * @brief The JIT a program runs in, and what it needs to define lazily
+ * translated branches.
+ */
+struct JITSession {
+  orc::LLJIT &jit;
+  orc::ThreadSafeContext context;
+  orc::LazyCallThroughManager &callThroughs;
+  orc::IndirectStubsManager &stubs;
+};
+
+void exitOnError(Error error) {
+  if (error) {
+    errs() << toString(std::move(error)) << "\n";
+    exit(1);
+  }
+}
+
+/**
+ * @brief Writes every function the JIT loads to /tmp/perf-<pid>.map, so that
+ * perf can name the code it samples.
+ */
+class PerfMapListener : public JITEventListener {
+public:
+  PerfMapListener()
+      : map("/tmp/perf-" + std::to_string(sys::Process::getProcessId()) +
+                ".map",
+            error, sys::fs::OF_Append) {
+    if (error) {
+      errs() << "Could not open the perf map: " << error.message() << "\n";
+    }
+  }
+
+  void notifyObjectLoaded(ObjectKey, const object::ObjectFile &object,
+                          const RuntimeDyld::LoadedObjectInfo &info) override {
+    if (error) {
+      return;
+    }
+
+    // The object for debuggers has the load addresses of its sections.
+    auto loaded = info.getObjectForDebug(object);
+    const object::ObjectFile &loadedObject =
+        loaded.getBinary() ? *loaded.getBinary() : object;
+    for (auto &symbolSize : object::computeSymbolSizes(loadedObject)) {
+      auto type = symbolSize.first.getType();
+      auto name = symbolSize.first.getName();
+      auto address = symbolSize.first.getAddress();
+      if (!type || !name || !address ||
+          *type != object::SymbolRef::ST_Function) {
+        consumeError(type.takeError());
+        consumeError(name.takeError());
+        consumeError(address.takeError());
+        continue;
+      }
+
+      map << format("%llx %llx ", (unsigned long long)*address,
+                    (unsigned long long)symbolSize.second)
+          << *name << "\n";
+    }
+    map.flush();
+  }
+
+private:
+  std::error_code error;
+  raw_fd_ostream map;
+};
+} // namespace
+
+/**
+ * @brief Piet::LazyBranchUnit translates the body of a branch when the JIT
+ * needs it, i.e. when the branch is first called through its stub.
+ */
+class LazyBranchUnit : public orc::MaterializationUnit {
+public:
+  LazyBranchUnit(Translator &translator, JITSession &session, string name,
+                 Parse::GraphState entry)
+      : MaterializationUnit(
+            Interface(orc::SymbolFlagsMap{{session.jit.mangleAndIntern(name),
+                                           JITSymbolFlags::Exported |
+                                               JITSymbolFlags::Callable}},
+                      nullptr)),
+        translator(translator), session(session), name(std::move(name)),
+        entry(entry) {}
+
+  StringRef getName() const override { return "LazyBranchUnit"; }
+
+  void materialize(std::unique_ptr<orc::MaterializationResponsibility>
+                       responsibility) override {
+    auto module = translator.translateBranchModule(entry, name);
+    defineDeclaredBranches(translator, session);
+    session.jit.getIRCompileLayer().emit(
+        std::move(responsibility),
+        orc::ThreadSafeModule(std::move(module), session.context));
+  }
+
+  /*!
+   * @brief Define a stub and a lazily translated body for every branch the
+   * translator declared since the last call.
+   */
+  static void defineDeclaredBranches(Translator &translator,
+                                     JITSession &session) {
+    auto &dylib = session.jit.getMainJITDylib();
+    for (auto &declared : translator.declaredBranches) {
+      auto bodyName = declared.first + ".body";
+      exitOnError(dylib.define(std::make_unique<LazyBranchUnit>(
+          translator, session, bodyName, declared.second)));
+
+      orc::SymbolAliasMap stub;
+      stub[session.jit.mangleAndIntern(declared.first)] =
+          orc::SymbolAliasMapEntry(session.jit.mangleAndIntern(bodyName),
+                                   JITSymbolFlags::Exported |
+                                       JITSymbolFlags::Callable);
+      exitOnError(dylib.define(orc::lazyReexports(
+          session.callThroughs, session.stubs, dylib, std::move(stub))));
+    }
+    translator.declaredBranches.clear();
+  }
+
+private:
+  void discard(const orc::JITDylib &, const orc::SymbolStringPtr &) override {}
+
+  Translator &translator;
+  JITSession &session;
+  string name;
+  Parse::GraphState entry;
+};
+
+int Translator::run() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+
+  // The whole program is translated up front if it's one function, if it
+  // shares a stack or the runtime library within the module, or if main
+  // registers its profiled sites.
+  declareBranches = !options.singleFunction && !options.inlineStack &&
+                    !options.linkRuntime && !options.instrument;
+  // Branches are translated when they're called, on the thread calling them.
+  options.jobs = 1;
+
+  registerPietGlobals();
+  translateMain();
+  if (options.linkRuntime) {
+    linkRuntime();
+  }
+  createTargetMachine();
+  optimiseModule();
+
+  orc::JITTargetMachineBuilder machineBuilder(targetMachine->getTargetTriple());
+  machineBuilder.setCPU(targetMachine->getTargetCPU().str());
+  machineBuilder.addFeatures(
+      SubtargetFeatures(targetMachine->getTargetFeatureString()).getFeatures());
+  machineBuilder.setCodeGenOptLevel(targetMachine->getOptLevel());
+  // Debuggers and profilers are told about every object the JIT loads.
+  vector<JITEventListener *> listeners;
+  std::unique_ptr<PerfMapListener> perfMapListener;
+  if (options.perfMap) {
+    perfMapListener.reset(new PerfMapListener);
+    listeners.push_back(perfMapListener.get());
+  }
+  if (options.debugInfo) {
+    listeners.push_back(JITEventListener::createGDBRegistrationListener());
+  }
+
+  orc::LLJITBuilder jitBuilder;
+  jitBuilder.setJITTargetMachineBuilder(std::move(machineBuilder));
+  if (!listeners.empty()) {
+    jitBuilder.setObjectLinkingLayerCreator(
+        [&listeners](orc::ExecutionSession &executionSession, const Triple &) {
+          auto layer = std::make_unique<orc::RTDyldObjectLinkingLayer>(
+              executionSession,
+              []() { return std::make_unique<SectionMemoryManager>(); });
+          for (auto listener : listeners) {
+            layer->registerJITEventListener(*listener);
+          }
+          return std::unique_ptr<orc::ObjectLayer>(std::move(layer));
+        });
+  }
+  auto jit = jitBuilder.create();
+  if (!jit) {
+    exitOnError(jit.takeError());
+  }
+
+  // The runtime library is part of mondriaan itself.
+  auto &dylib = (*jit)->getMainJITDylib();
+  auto processSymbols =
+      orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+          (*jit)->getDataLayout().getGlobalPrefix());
+  if (!processSymbols) {
+    exitOnError(processSymbols.takeError());
+  }
+  dylib.addGenerator(std::move(*processSymbols));
+
+  auto &executionSession = (*jit)->getExecutionSession();
+  auto callThroughs = orc::createLocalLazyCallThroughManager(
+      (*jit)->getTargetTriple(), executionSession, 0);
+  if (!callThroughs) {
+    exitOnError(callThroughs.takeError());
+  }
+  auto stubs =
+      orc::createLocalIndirectStubsManagerBuilder((*jit)->getTargetTriple())();
+
+  JITSession session{**jit, orc::ThreadSafeContext(std::move(ownedContext)),
+                     **callThroughs, *stubs};
+  LazyBranchUnit::defineDeclaredBranches(*this, session);
+  exitOnError((*jit)->addIRModule(
+      orc::ThreadSafeModule(std::move(module), session.context)));
+  exitOnError((*jit)->initialize(dylib));
+
+  auto mainSymbol = (*jit)->lookup("main");
+  if (!mainSymbol) {
+    exitOnError(mainSymbol.takeError());
+  }
+  auto programMain = (int (*)(int, char))mainSymbol->getAddress();
+  int exitCode = programMain(0, 0);
+
+  // The counters of the profile are freed with the JIT, before the atexit
+  // handler of the runtime library would write them.
+  if (options.instrument) {
+    mondriaan_runtime_finish_profile();
+  }
+  exitOnError((*jit)->deinitialize(dylib));
+  return exitCode;
+}
+} // namespace Piet
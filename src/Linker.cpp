@@ -0,0 +1,139 @@
+#include "../include/Piet.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Program.h>
+#include <llvm/Support/raw_ostream.h>
+
+#ifdef MONDRIAAN_HAVE_LLD
+#include <lld/Common/Driver.h>
+#endif
+
+#include <cstdlib>
+#include <iostream>
+
+using namespace llvm;
+
+namespace Piet {
+#ifdef MONDRIAAN_HAVE_LLD
+namespace {
+/**
+ * @brief Split a comma separated list configured at build time.
+ */
+vector<string> splitList(StringRef list) {
+  SmallVector<StringRef, 8> parts;
+  list.split(parts, ',', -1, false);
+  return vector<string>(parts.begin(), parts.end());
+}
+} // namespace
+#endif
+
+string Linker::runtimeDirectory() {
+  if (auto directory = getenv("MONDRIAAN_RUNTIME_DIR")) {
+    return directory;
+  }
+
+  return MONDRIAAN_RUNTIME_DIR;
+}
+
+Linker::Linker() {
+  SmallString<128> runtimeArchivePath(runtimeDirectory());
+  sys::path::append(runtimeArchivePath, "libMondriaanRuntime.a");
+  runtimeArchive = runtimeArchivePath.str().str();
+  if (!sys::fs::exists(runtimeArchive)) {
+    errs() << "Could not find the runtime library " << runtimeArchive
+           << ". Set MONDRIAAN_RUNTIME_DIR to the directory containing "
+              "libMondriaanRuntime.a.\n";
+    exit(1);
+  }
+}
+
+const string &Linker::getRuntimeArchive() const { return runtimeArchive; }
+
+bool Linker::link(const vector<string> &objectFilenames,
+                  const string &executableFilename) {
+#ifdef MONDRIAAN_HAVE_LLD
+  // Link statically, so the dynamic linker of the host doesn't have to be
+  // known. The start files and library directories of the C++ compiler are
+  // looked up when Mondriaan is configured.
+  auto startFiles = splitList(MONDRIAAN_LINK_START_FILES);
+  auto endFiles = splitList(MONDRIAAN_LINK_END_FILES);
+  auto libraryDirectories = splitList(MONDRIAAN_LINK_DIRECTORIES);
+
+  vector<string> arguments{"ld.lld", "-static", "-o", executableFilename};
+  arguments.insert(arguments.end(), startFiles.begin(), startFiles.end());
+  for (auto &directory : libraryDirectories) {
+    arguments.push_back("-L" + directory);
+  }
+  arguments.insert(arguments.end(), objectFilenames.begin(),
+                   objectFilenames.end());
+  arguments.insert(arguments.end(),
+                   {runtimeArchive, "-lstdc++", "-lm", "--start-group",
+                    "-lgcc", "-lgcc_eh", "-lc", "--end-group"});
+  arguments.insert(arguments.end(), endFiles.begin(), endFiles.end());
+  return linkInProcess(arguments);
+#else
+  vector<string> arguments(objectFilenames);
+  arguments.insert(arguments.end(), {runtimeArchive, "-o", executableFilename});
+  return linkWithDriver(arguments);
+#endif
+}
+
+bool Linker::combine(const vector<string> &objectFilenames,
+                     const string &outputFilename) {
+#ifdef MONDRIAAN_HAVE_LLD
+  vector<string> arguments{"ld.lld", "-r", "-o", outputFilename};
+  arguments.insert(arguments.end(), objectFilenames.begin(),
+                   objectFilenames.end());
+  return linkInProcess(arguments);
+#else
+  vector<string> arguments{"-r", "-nostdlib", "-o", outputFilename};
+  arguments.insert(arguments.end(), objectFilenames.begin(),
+                   objectFilenames.end());
+  return linkWithDriver(arguments);
+#endif
+}
+
+#ifdef MONDRIAAN_HAVE_LLD
+bool Linker::linkInProcess(const vector<string> &arguments) {
+  vector<const char *> argumentPointers;
+  for (auto &argument : arguments) {
+    argumentPointers.push_back(argument.c_str());
+  }
+
+  return lld::elf::link(argumentPointers, outs(), errs(), false, false);
+}
+#endif
+
+bool Linker::linkWithDriver(const vector<string> &arguments) {
+  auto driverName = getenv("CXX");
+  auto driver = sys::findProgramByName(driverName ? driverName : "c++");
+  if (!driver) {
+    errs() << "Could not find a C++ compiler to link with. Set CXX to the "
+              "compiler to use.\n";
+    return false;
+  }
+
+  vector<string> driverArguments{*driver};
+  driverArguments.insert(driverArguments.end(), arguments.begin(),
+                         arguments.end());
+  string errorMessage;
+  vector<StringRef> argumentRefs(driverArguments.begin(),
+                                 driverArguments.end());
+  int result = sys::ExecuteAndWait(*driver, argumentRefs, None, {}, 0, 0,
+                                   &errorMessage);
+  if (result != 0) {
+    errs() << "Linking failed";
+    if (!errorMessage.empty()) {
+      errs() << ": " << errorMessage;
+    }
+    errs() << "\n";
+    return false;
+  }
+
+  return true;
+}
+} // namespace Piet
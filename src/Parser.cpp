@@ -3,6 +3,9 @@
 #include <stack>
 
 namespace Piet::Parse {
+//! The interval between the blocks whose labelling is traced.
+const uint32_t blockTraceInterval = 64;
+
 Position *move(DirectionPoint inDirection, Image *image, Position position) {
   Position *next = nullptr;
 
@@ -374,6 +377,7 @@ Graph *Parser::parse() {
   vector<char> identifierParts = {'A'};
   auto whiteBlockParser = new WhiteBlockParser{image};
 
+  TimeReport::Phase labelling("labelling");
   while (!visitPositions.empty()) {
     auto position = visitPositions.top();
     visitPositions.pop();
@@ -390,10 +394,18 @@ Graph *Parser::parse() {
     }
 
     cellOwner++;
+    // Only a sample of the blocks is traced, or the spans of the blocks would
+    // be most of the trace.
+    bool traceBlock = cellOwner % blockTraceInterval == 1;
+    Trace::Span blockSpan(
+        "label block",
+        traceBlock ? identifierFromParts(identifierParts) : "", traceBlock);
     CodelBlock *block = visitBlock(cellOwner, image, position);
-    block->constructingNode = new GraphNode(
-        block->color, block->size, identifierFromParts(identifierParts));
+    block->constructingNode =
+        new GraphNode(block->color, block->size,
+                      identifierFromParts(identifierParts), position);
     incrementIdentifierParts(identifierParts);
+    blockSpan.end();
     blocks.push_back(block);
     assert(blocks.at(cellOwner - 1) == block);
 
@@ -446,7 +458,10 @@ Graph *Parser::parse() {
     }
   }
 
+  labelling.end();
+
   // Connect the nodes together.
+  TimeReport::Phase edgeConstruction("edge construction");
   for (auto block : blocks) {
     // Add the edges to the node.
     if (block->rightTopExit) {
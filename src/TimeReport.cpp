@@ -0,0 +1,130 @@
+#include "../include/Piet.h"
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <chrono>
+#include <sys/resource.h>
+
+using namespace llvm;
+
+namespace Piet {
+namespace {
+/**
+ * @brief The resources used by the process up to a point in time, or used by
+ * a phase.
+ */
+struct Usage {
+  double wall = 0;
+  double user = 0;
+  double system = 0;
+  int64_t peakKilobytes = 0;
+
+  static Usage now() {
+    sys::TimePoint<> elapsed;
+    std::chrono::nanoseconds user, system;
+    sys::Process::GetTimeUsage(elapsed, user, system);
+
+    struct rusage resources;
+    getrusage(RUSAGE_SELF, &resources);
+
+    Usage usage;
+    usage.wall = std::chrono::duration<double>(
+                     std::chrono::steady_clock::now().time_since_epoch())
+                     .count();
+    usage.user = std::chrono::duration<double>(user).count();
+    usage.system = std::chrono::duration<double>(system).count();
+#ifdef __APPLE__
+    // macOS reports the peak in bytes, Linux in kilobytes.
+    usage.peakKilobytes = resources.ru_maxrss / 1024;
+#else
+    usage.peakKilobytes = resources.ru_maxrss;
+#endif
+    return usage;
+  }
+
+  void add(const Usage &from, const Usage &to) {
+    wall += to.wall - from.wall;
+    user += to.user - from.user;
+    system += to.system - from.system;
+    peakKilobytes += to.peakKilobytes - from.peakKilobytes;
+  }
+};
+
+bool enabled = false;
+vector<pair<string, Usage>> phases;
+vector<size_t> activePhases;
+Usage lastUsage;
+
+/*!
+ * @brief Charge the resources used since the last change of phase to the
+ * active phase.
+ */
+void chargeActivePhase() {
+  Usage usage = Usage::now();
+  if (!activePhases.empty()) {
+    phases[activePhases.back()].second.add(lastUsage, usage);
+  }
+  lastUsage = usage;
+}
+} // namespace
+
+TimeReport::Phase::Phase(const string &name) : span(name) {
+  if (!enabled) {
+    return;
+  }
+
+  active = true;
+  chargeActivePhase();
+  size_t phase = 0;
+  while (phase < phases.size() && phases[phase].first != name) {
+    phase++;
+  }
+  if (phase == phases.size()) {
+    phases.emplace_back(name, Usage());
+  }
+  activePhases.push_back(phase);
+}
+
+TimeReport::Phase::~Phase() { end(); }
+
+void TimeReport::Phase::end() {
+  span.end();
+  if (!active) {
+    return;
+  }
+
+  active = false;
+  chargeActivePhase();
+  activePhases.pop_back();
+}
+
+void TimeReport::enable() { enabled = true; }
+
+bool TimeReport::isEnabled() { return enabled; }
+
+void TimeReport::print(raw_ostream &stream) {
+  stream << "===" << string(73, '-') << "===\n"
+         << "                      Mondriaan compilation time report\n"
+         << "===" << string(73, '-') << "===\n"
+         << "  Phase                    Wall (s)     User (s)   System (s)"
+            "   Peak RSS (KiB)\n";
+
+  Usage total;
+  for (auto &phase : phases) {
+    const Usage &usage = phase.second;
+    stream << format("  %-20s %12.4f %12.4f %12.4f %+16lld\n",
+                     phase.first.c_str(), usage.wall, usage.user,
+                     usage.system, (long long)usage.peakKilobytes);
+    total.wall += usage.wall;
+    total.user += usage.user;
+    total.system += usage.system;
+    total.peakKilobytes += usage.peakKilobytes;
+  }
+  const char *totalName = "Total";
+  stream << format("  %-20s %12.4f %12.4f %12.4f %+16lld\n", totalName,
+                   total.wall, total.user, total.system,
+                   (long long)total.peakKilobytes);
+}
+} // namespace Piet
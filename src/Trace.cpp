@@ -0,0 +1,71 @@
+#include "../include/Piet.h"
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <llvm/Support/TimeProfiler.h>
+
+using namespace llvm;
+
+namespace Piet {
+namespace {
+bool enabled = false;
+
+//! Record every span, however short: the spans of a block are microseconds.
+const unsigned granularity = 0;
+const char *processName = "mondriaan";
+} // namespace
+
+Trace::Span::Span(const string &name, const string &detail, bool sampled) {
+  if (!sampled || !timeTraceProfilerEnabled()) {
+    return;
+  }
+
+  active = true;
+  timeTraceProfilerBegin(name, detail);
+}
+
+Trace::Span::~Span() { end(); }
+
+void Trace::Span::end() {
+  if (!active) {
+    return;
+  }
+
+  active = false;
+  timeTraceProfilerEnd();
+}
+
+void Trace::enable() {
+  enabled = true;
+  timeTraceProfilerInitialize(granularity, processName);
+}
+
+bool Trace::isEnabled() { return enabled; }
+
+void Trace::startThread() {
+  if (enabled) {
+    timeTraceProfilerInitialize(granularity, processName);
+  }
+}
+
+void Trace::finishThread() {
+  if (enabled) {
+    timeTraceProfilerFinishThread();
+  }
+}
+
+bool Trace::write(const string &filename) {
+  std::error_code error;
+  raw_fd_ostream trace(filename, error, sys::fs::OF_None);
+  if (error) {
+    errs() << "Could not write the trace " << filename << ": "
+           << error.message() << "\n";
+    return false;
+  }
+
+  timeTraceProfilerWrite(trace);
+  timeTraceProfilerCleanup();
+  return true;
+}
+} // namespace Piet
@@ -1,90 +1,282 @@
 #include "../include/Piet.h"
 
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/DIBuilder.h>
+#include <llvm/IR/DebugInfoMetadata.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/InstrTypes.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/MDBuilder.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/MC/SubtargetFeature.h>
+#include <llvm/MC/TargetRegistry.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Passes/StandardInstrumentations.h>
 #include <llvm/Support/FileSystem.h>
-#include <llvm/Support/TargetRegistry.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/IPO/Internalize.h>
+#include <llvm/Transforms/IPO/MergeFunctions.h>
+#include <llvm/Transforms/Utils/SplitModule.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
 #include <iostream>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 using namespace llvm;
 
 namespace Piet {
-Function *push;
-Function *duplicate;
-Function *outChar;
-Function *outNumber;
-Function *pointerBranch;
-Function *inNumber;
-Function *multiply;
-Function *divide;
-Function *roll;
+#ifdef MONDRIAAN_HAVE_RUNTIME_BITCODE
+//! The runtime library as LLVM bitcode, compiled when Mondriaan is built.
+const unsigned char runtimeBitcodeBytes[] = {
+#include "RuntimeBitcode.inc"
+};
+#endif
+
+StringRef Translator::runtimeBitcode() {
+#ifdef MONDRIAAN_HAVE_RUNTIME_BITCODE
+  return StringRef(reinterpret_cast<const char *>(runtimeBitcodeBytes),
+                   sizeof(runtimeBitcodeBytes));
+#else
+  return StringRef();
+#endif
+}
 
 void Translator::registerPietGlobals() {
+  // Code of the previous module must not leak its locations into this one.
+  builder.SetCurrentDebugLocation(DebugLoc());
+
   Type *voidTy = Type::getVoidTy(context);
+  Type *int8Ty = Type::getInt8Ty(context);
   Type *int32Ty = Type::getInt32Ty(context);
-  vector<Type *> noArgs{};
+  Type *int64Ty = Type::getInt64Ty(context);
+  // Every operation takes the runtime context of the program.
+  PointerType *contextPtrTy = runtimeContextType(context)->getPointerTo();
+  vector<Type *> noArgs{contextPtrTy};
 
   // Register push.
   FunctionType *pushType =
-      FunctionType::get(voidTy, std::vector<Type *>(1, int32Ty), false);
+      FunctionType::get(voidTy, {contextPtrTy, int64Ty}, false);
   push = Function::Create(pushType, Function::ExternalLinkage,
-                          "mondriaan_runtime_push", &module);
+                          "mondriaan_runtime_push", module.get());
 
   // Register out(char).
   FunctionType *outCharType = FunctionType::get(voidTy, noArgs, false);
   outChar = Function::Create(outCharType, Function::ExternalLinkage,
-                             "mondriaan_runtime_out_char", &module);
+                             "mondriaan_runtime_out_char", module.get());
 
   // Register out(number).
   FunctionType *outNumberType = FunctionType::get(voidTy, noArgs, false);
   outNumber = Function::Create(outNumberType, Function::ExternalLinkage,
-                               "mondriaan_runtime_out_number", &module);
+                               "mondriaan_runtime_out_number", module.get());
 
   // Register duplicate.
   FunctionType *duplicateType = FunctionType::get(voidTy, noArgs, false);
   duplicate = Function::Create(duplicateType, Function::ExternalLinkage,
-                               "mondriaan_runtime_duplicate", &module);
+                               "mondriaan_runtime_duplicate", module.get());
 
   // Register pointer.
-  FunctionType *pointerType = FunctionType::get(int32Ty, noArgs, false);
+  FunctionType *pointerType = FunctionType::get(int8Ty, noArgs, false);
   pointerBranch = Function::Create(pointerType, Function::ExternalLinkage,
-                                   "mondriaan_runtime_pointer", &module);
+                                   "mondriaan_runtime_pointer", module.get());
+
+  // Register switch.
+  FunctionType *switchType = FunctionType::get(int8Ty, noArgs, false);
+  switchBranch = Function::Create(switchType, Function::ExternalLinkage,
+                                  "mondriaan_runtime_switch", module.get());
 
   // Register in(number);
   FunctionType *inNumberType = FunctionType::get(voidTy, noArgs, false);
   inNumber = Function::Create(inNumberType, Function::ExternalLinkage,
-                              "mondriaan_runtime_in_number", &module);
+                              "mondriaan_runtime_in_number", module.get());
+
+  // Register in(char);
+  FunctionType *inCharType = FunctionType::get(voidTy, noArgs, false);
+  inChar = Function::Create(inCharType, Function::ExternalLinkage,
+                            "mondriaan_runtime_in_char", module.get());
 
   // Register multiply.
   FunctionType *multiplyType = FunctionType::get(voidTy, noArgs, false);
   multiply = Function::Create(multiplyType, Function::ExternalLinkage,
-                              "mondriaan_runtime_multiply", &module);
+                              "mondriaan_runtime_multiply", module.get());
 
   // Register divide.
   FunctionType *divideType = FunctionType::get(voidTy, noArgs, false);
   divide = Function::Create(divideType, Function::ExternalLinkage,
-                            "mondriaan_runtime_divide", &module);
+                            "mondriaan_runtime_divide", module.get());
 
   // Register roll.
   FunctionType *rollType = FunctionType::get(voidTy, noArgs, false);
   roll = Function::Create(rollType, Function::ExternalLinkage,
-                          "mondriaan_runtime_roll", &module);
+                          "mondriaan_runtime_roll", module.get());
+
+  // Register write char.
+  FunctionType *writeCharType =
+      FunctionType::get(voidTy, {contextPtrTy, int64Ty}, false);
+  writeChar = Function::Create(writeCharType, Function::ExternalLinkage,
+                               "mondriaan_runtime_write_char", module.get());
+
+  // Register write number.
+  FunctionType *writeNumberType =
+      FunctionType::get(voidTy, {contextPtrTy, int64Ty}, false);
+  writeNumber = Function::Create(writeNumberType, Function::ExternalLinkage,
+                                 "mondriaan_runtime_write_number",
+                                 module.get());
+
+  // Register read number.
+  FunctionType *readNumberType = FunctionType::get(
+      Type::getInt1Ty(context), {contextPtrTy, Type::getInt64PtrTy(context)},
+      false);
+  readNumber = Function::Create(readNumberType, Function::ExternalLinkage,
+                                "mondriaan_runtime_read_number", module.get());
+
+  // Register read char.
+  FunctionType *readCharType = FunctionType::get(
+      Type::getInt1Ty(context), {contextPtrTy, Type::getInt64PtrTy(context)},
+      false);
+  readChar = Function::Create(readCharType, Function::ExternalLinkage,
+                              "mondriaan_runtime_read_char", module.get());
+
+  if (options.inlineStack) {
+    inlineStack.registerGlobals(writeChar, writeNumber, readNumber, readChar);
+  }
+
+  // Register the statistics of $MONDRIAAN_STATS.
+  statsEnabled = new GlobalVariable(*module, int8Ty, false,
+                                    GlobalValue::ExternalLinkage, nullptr,
+                                    "mondriaan_runtime_stats_enabled");
+  FunctionType *countType =
+      FunctionType::get(voidTy, {contextPtrTy, int32Ty, int64Ty}, false);
+  statsCount = Function::Create(countType, Function::ExternalLinkage,
+                                "mondriaan_runtime_count", module.get());
+
+  // Register profile program and sites.
+  if (options.instrument) {
+    profileProgram = Function::Create(
+        FunctionType::get(voidTy, {Type::getInt8PtrTy(context)}, false),
+        Function::ExternalLinkage, "mondriaan_runtime_profile_program",
+        module.get());
+    FunctionType *profileSiteType = FunctionType::get(
+        voidTy,
+        {Type::getInt8PtrTy(context), Type::getInt64PtrTy(context), int32Ty},
+        false);
+    profileSite =
+        Function::Create(profileSiteType, Function::ExternalLinkage,
+                         "mondriaan_runtime_profile_site", module.get());
+  }
+
+  if (options.debugInfo) {
+    createDebugInfo();
+  }
 }
 
-void Translator::translateIRToExecutable(string objectFilename) {
+void Translator::createDebugInfo() {
+  module->addModuleFlag(Module::Warning, "Debug Info Version",
+                        DEBUG_METADATA_VERSION);
+  module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+
+  // The image is the source file: a line is a row of codels, and a column a
+  // column of codels.
+  debugBuilder.reset(new DIBuilder(*module));
+  SmallString<128> directory(sys::path::parent_path(options.sourceFilename));
+  sys::fs::make_absolute(directory);
+  debugFile = debugBuilder->createFile(
+      sys::path::filename(options.sourceFilename), directory);
+  debugUnit = debugBuilder->createCompileUnit(
+      dwarf::DW_LANG_C, debugFile, "Mondriaan",
+      options.optimisationLevel > 0, "", 0);
+}
+
+void Translator::attachDebugInfo(Function *function, Parse::GraphNode *node) {
+  if (!debugBuilder) {
+    return;
+  }
+
+  unsigned line = node->getPosition().row + 1;
+  DISubroutineType *type = debugBuilder->createSubroutineType(
+      debugBuilder->getOrCreateTypeArray(None));
+  DISubprogram *subprogram = debugBuilder->createFunction(
+      debugUnit, function->getName(), function->getName(), debugFile, line,
+      type, line, DINode::FlagZero,
+      DISubprogram::SPFlagDefinition |
+          (function->hasLocalLinkage() ? DISubprogram::SPFlagLocalToUnit
+                                       : DISubprogram::SPFlagZero));
+  function->setSubprogram(subprogram);
+  debugBuilder->finalizeSubprogram(subprogram);
+}
+
+void Translator::finishDebugInfo() {
+  if (debugBuilder) {
+    debugBuilder->finalize();
+  }
+}
+
+void Translator::translateDebugLocation(Parse::GraphNode *node) {
+  if (!debugBuilder) {
+    return;
+  }
+
+  DISubprogram *subprogram =
+      builder.GetInsertBlock()->getParent()->getSubprogram();
+  Parse::Position position = node->getPosition();
+  builder.SetCurrentDebugLocation(DILocation::get(
+      context, position.row + 1, position.column + 1, subprogram));
+}
+
+void Translator::linkRuntime() {
+  TimeReport::Phase runtimeLinking("runtime linking");
+#ifdef MONDRIAAN_HAVE_RUNTIME_BITCODE
+  auto runtime = parseBitcodeFile(
+      MemoryBufferRef(runtimeBitcode(), "runtime.bc"), context);
+  if (!runtime) {
+    errs() << "Could not read the runtime library: "
+           << toString(runtime.takeError()) << "\n";
+    exit(1);
+  }
+
+  if (llvm::Linker::linkModules(*module, std::move(*runtime))) {
+    exit(1);
+  }
+
+  // The runtime is compiled for the CPU of whoever built Mondriaan. Compile it
+  // for the same CPU as the program instead, so it can be inlined.
+  for (Function &function : *module) {
+    function.removeFnAttr("target-cpu");
+    function.removeFnAttr("target-features");
+  }
+
+  // Only main and the program it runs are called from outside of the program,
+  // so the optimiser is free to inline, specialise or remove everything else.
+  internalizeModule(*module, [](const GlobalValue &value) {
+    return value.getName() == "main" ||
+           value.getName() == "mondriaan_program";
+  });
+#else
+  errs() << "Mondriaan was built without the runtime library bitcode. Build it "
+            "with clang available to link the runtime into programs.\n";
+  exit(1);
+#endif
+}
+
+void Translator::createTargetMachine() {
   // Initialize the target registry etc.
   InitializeAllTargetInfos();
   InitializeAllTargets();
@@ -92,8 +284,12 @@ void Translator::translateIRToExecutable(string objectFilename) {
   InitializeAllAsmParsers();
   InitializeAllAsmPrinters();
 
+  targetMachine = buildTargetMachine();
+  configureModuleTarget();
+}
+
+TargetMachine *Translator::buildTargetMachine() const {
   auto targetTriple = sys::getDefaultTargetTriple();
-  module.setTargetTriple(targetTriple);
 
   std::string error;
   auto target = TargetRegistry::lookupTarget(targetTriple, error);
@@ -106,265 +302,1125 @@ void Translator::translateIRToExecutable(string objectFilename) {
     exit(1);
   }
 
-  auto cpu = "generic";
-  auto features = "";
+  string cpu = options.cpu;
+  SubtargetFeatures features;
+  if (cpu == "native") {
+    cpu = sys::getHostCPUName();
+
+    StringMap<bool> hostFeatures;
+    if (sys::getHostCPUFeatures(hostFeatures)) {
+      for (auto &hostFeature : hostFeatures) {
+        features.AddFeature(hostFeature.first(), hostFeature.second);
+      }
+    }
+  }
+
+  // Explicit features are added last, to override those of the host.
+  if (!options.features.empty()) {
+    features.AddFeature(options.features);
+  }
+
+  CodeGenOpt::Level codeGenLevel;
+  switch (options.optimisationLevel) {
+  case 0:
+    codeGenLevel = CodeGenOpt::None;
+    break;
+  case 1:
+    codeGenLevel = CodeGenOpt::Less;
+    break;
+  case 2:
+    codeGenLevel = CodeGenOpt::Default;
+    break;
+  default:
+    codeGenLevel = CodeGenOpt::Aggressive;
+    break;
+  }
 
+  // Position independent code can be linked into position independent
+  // executables, the default of current toolchains.
   TargetOptions opt;
-  auto rm = Optional<Reloc::Model>();
-  auto targetMachine =
-      target->createTargetMachine(targetTriple, cpu, features, opt, rm);
+  auto rm = Optional<Reloc::Model>(Reloc::PIC_);
+  return target->createTargetMachine(targetTriple, cpu, features.getString(),
+                                     opt, rm, None, codeGenLevel);
+}
+
+void Translator::configureModuleTarget() {
+  module->setTargetTriple(targetMachine->getTargetTriple().str());
+  module->setDataLayout(targetMachine->createDataLayout());
+
+  // Record the CPU in the functions too, so that IR emitted with -S is
+  // compiled for the same CPU later on.
+  auto cpu = targetMachine->getTargetCPU();
+  auto features = targetMachine->getTargetFeatureString();
+  for (Function &function : *module) {
+    if (function.isDeclaration()) {
+      continue;
+    }
 
-  module.setDataLayout(targetMachine->createDataLayout());
+    function.addFnAttr("target-cpu", cpu);
+    if (!features.empty()) {
+      function.addFnAttr("target-features", features);
+    }
+  }
+}
+
+void Translator::optimiseModule() {
+  if (options.optimisationLevel == 0) {
+    return;
+  }
+
+  TimeReport::Phase optimisation("optimisation");
+
+  OptimizationLevel level = OptimizationLevel::O2;
+  switch (options.optimisationLevel) {
+  case 1:
+    level = OptimizationLevel::O1;
+    break;
+  case 2:
+    level = options.optimiseForSize ? OptimizationLevel::Os
+                                    : OptimizationLevel::O2;
+    break;
+  default:
+    level = OptimizationLevel::O3;
+    break;
+  }
+
+  // Time the passes with -time-passes, if --time-report enables them.
+  PassInstrumentationCallbacks instrumentationCallbacks;
+  StandardInstrumentations standardInstrumentations(false);
+  standardInstrumentations.registerCallbacks(instrumentationCallbacks);
 
+  LoopAnalysisManager loopAnalyses;
+  FunctionAnalysisManager functionAnalyses;
+  CGSCCAnalysisManager cgsccAnalyses;
+  ModuleAnalysisManager moduleAnalyses;
+
+  PassBuilder passBuilder(targetMachine, PipelineTuningOptions(), None,
+                          &instrumentationCallbacks);
+  passBuilder.registerModuleAnalyses(moduleAnalyses);
+  passBuilder.registerCGSCCAnalyses(cgsccAnalyses);
+  passBuilder.registerFunctionAnalyses(functionAnalyses);
+  passBuilder.registerLoopAnalyses(loopAnalyses);
+  passBuilder.crossRegisterProxies(loopAnalyses, functionAnalyses,
+                                   cgsccAnalyses, moduleAnalyses);
+
+  ModulePassManager modulePasses =
+      passBuilder.buildPerModuleDefaultPipeline(level);
+  // Different sequences often optimise to the same code.
+  modulePasses.addPass(MergeFunctionsPass());
+  modulePasses.run(*module, moduleAnalyses);
+}
+
+void Translator::translateIRToExecutable(string objectFilename) {
   std::error_code ec;
-  raw_fd_ostream dest(objectFilename, ec, sys::fs::F_None);
+  raw_fd_ostream dest(objectFilename, ec, sys::fs::OF_None);
 
   if (ec) {
     errs() << "Could not open file: " << ec.message();
     exit(1);
   }
 
+  emitObject(*module, *targetMachine, dest);
+  dest.flush();
+}
+
+void Translator::emitObject(Module &objectModule, TargetMachine &machine,
+                            raw_pwrite_stream &dest) {
   // TODO: maybe not use something with legacy in the name.
   legacy::PassManager pass;
 
-  if (targetMachine->addPassesToEmitFile(pass, dest,
-                                         TargetMachine::CGFT_ObjectFile)) {
+  bool unsupported =
+      machine.addPassesToEmitFile(pass, dest, nullptr, CGFT_ObjectFile);
+  if (unsupported) {
     errs() << "the target machine can't emit a file of this type";
     exit(1);
   }
 
-  pass.run(module);
-  dest.flush();
+  pass.run(objectModule);
 }
 
-Function *Translator::translateBranch(Parse::GraphNode *node,
-                                      DirectionPoint dp) {
-  graph->restartWalk(node, dp);
-
-  Function *openFunction = Function::Create(
-      FunctionType::get(Type::getVoidTy(context), false),
-      Function::PrivateLinkage, "next_mondriaan_sequence", &module);
-
-  BasicBlock *openBlock =
-      BasicBlock::Create(context, "mondriaan_seq", openFunction);
-  builder.SetInsertPoint(openBlock);
-
-  Parse::GraphStep *step;
-  string sequenceID;
-
-  // while (stack is not empty) OR (we can continue walking the graph)
-  while ((step = graph->walk()) != nullptr) {
-    if (sequenceID.empty()) {
-      sequenceID = step->previous->getIdentifier();
-    } else {
-      sequenceID += "_" + step->previous->getIdentifier();
-    }
-
-    // Determine operation from step.
-    auto transition = !step->skipTransition
-                          ? ColorTransition::determineTransition(step->previous,
-                                                                 step->current)
-                          : nullptr;
-    if (transition == nullptr) {
-      // No operation.
-    } else {
-      assert(transition->getHueChange() < operationTable.size());
-      assert(transition->getLightnessChange() <
-             operationTable[transition->getHueChange()].size());
-      string operation = operationTable[transition->getHueChange()]
-                                       [transition->getLightnessChange()];
-      assert(!operation.empty());
-
-      if (operation == OP_PUSH) {
-        vector<Value *> pushArgs;
-        pushArgs.push_back(ConstantInt::get(
-            Type::getInt32Ty(context), APInt(32, step->previous->getSize())));
-        builder.CreateCall(push, pushArgs);
-      } else if (operation == OP_OUT_CHAR) {
-        builder.CreateCall(outChar);
-      } else if (operation == OP_OUT_NUMBER) {
-        builder.CreateCall(outNumber);
-      } else if (operation == OP_DUPLICATE) {
-        builder.CreateCall(duplicate);
-      } else if (operation == OP_IN_NUMBER) {
-        builder.CreateCall(inNumber);
-      } else if (operation == OP_MULTIPLY) {
-        builder.CreateCall(multiply);
-      } else if (operation == OP_DIVIDE) {
-        builder.CreateCall(divide);
-      } else if (operation == OP_ROLL) {
-        builder.CreateCall(roll);
-      } else if (operation == OP_POINTER) {
-        if (translatedBranches[sequenceID]) {
-          openFunction->removeFromParent();
-          return translatedBranches[sequenceID];
-        }
+vector<string> Translator::translateIRToObjects() {
+  unsigned partitions = std::max(options.jobs, 1u);
+  vector<string> objectFilenames;
+  vector<std::unique_ptr<raw_fd_ostream>> objectStreams;
+  for (unsigned partition = 0; partition < partitions; partition++) {
+    SmallString<128> objectFilename;
+    int objectFile;
+    if (sys::fs::createTemporaryFile("mondriaan", "o", objectFile,
+                                     objectFilename)) {
+      errs() << "Could not create a temporary object file.\n";
+      exit(1);
+    }
+    objectFilenames.push_back(objectFilename.str().str());
+    objectStreams.emplace_back(new raw_fd_ostream(objectFile, true));
+  }
 
-        auto currentNode = graph->getCurrentNode();
-
-        // End the current function.
-        translatedBranches[sequenceID] = openFunction;
-        openFunction->setName(sequenceID);
-
-        // Call pointer in the entry block.
-        Value *pointerVal = builder.CreateCall(pointerBranch, None, "pointer");
-
-        // Create 4 new jump function prototypes each with their own block.
-        DirectionPoint noTurn = graph->getCurrentDirection(),
-                       singleTurn = incrementDirectionPointer(noTurn),
-                       doubleTurn = incrementDirectionPointer(singleTurn),
-                       tripleTurn = incrementDirectionPointer(doubleTurn);
-        auto noTurnBranch = translateBranch(currentNode, noTurn),
-             singleTurnBranch = translateBranch(currentNode, singleTurn),
-             doubleTurnBranch = translateBranch(currentNode, doubleTurn),
-             tripleTurnBranch = translateBranch(currentNode, tripleTurn);
-
-        BasicBlock *noTurnJumpBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.jmp.0", openFunction);
-        builder.SetInsertPoint(noTurnJumpBlock);
-        builder.CreateCall(noTurnBranch);
-        builder.CreateRetVoid();
-        BasicBlock *singleTurnJumpBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.jmp.1", openFunction);
-        builder.SetInsertPoint(singleTurnJumpBlock);
-        builder.CreateCall(singleTurnBranch);
-        builder.CreateRetVoid();
-        BasicBlock *doubleTurnJumpBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.jmp.2", openFunction);
-        builder.SetInsertPoint(doubleTurnJumpBlock);
-        builder.CreateCall(doubleTurnBranch);
-        builder.CreateRetVoid();
-        BasicBlock *tripleTurnJumpBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.jmp.3", openFunction);
-        builder.SetInsertPoint(tripleTurnJumpBlock);
-        builder.CreateCall(tripleTurnBranch);
-        builder.CreateRetVoid();
-
-        // Create 3 blocks for the 4-way logic.
-        BasicBlock *doubleTurnTestBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.test.2", openFunction);
-        builder.SetInsertPoint(doubleTurnTestBlock);
-        const auto twoVal = builder.getInt(APInt(32, 2));
-        Value *twoCondition =
-            builder.CreateICmp(CmpInst::ICMP_EQ, pointerVal, twoVal);
-        builder.CreateCondBr(twoCondition, doubleTurnJumpBlock,
-                             tripleTurnJumpBlock);
-        BasicBlock *singleTurnTestBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.test.1", openFunction);
-        builder.SetInsertPoint(singleTurnTestBlock);
-        const auto oneVal = builder.getInt(APInt(32, 1));
-        Value *oneCondition =
-            builder.CreateICmp(CmpInst::ICMP_EQ, pointerVal, oneVal);
-        builder.CreateCondBr(oneCondition, singleTurnJumpBlock,
-                             doubleTurnTestBlock);
-        BasicBlock *noTurnTestBlock = BasicBlock::Create(
-            context, "mondriaan.pointer.test.0", openFunction);
-        builder.SetInsertPoint(noTurnTestBlock);
-        const auto zeroVal = builder.getInt(APInt(32, 0));
-        Value *zeroCondition =
-            builder.CreateICmp(CmpInst::ICMP_EQ, pointerVal, zeroVal);
-        builder.CreateCondBr(zeroCondition, noTurnJumpBlock,
-                             singleTurnTestBlock);
-
-        // Jump to the start of logic blocks in the entry block.
-        builder.SetInsertPoint(openBlock);
-        builder.CreateBr(noTurnTestBlock);
-
-        /**
-         * entry:
-         *  %pointer = call mondriaan_pointer
-         *  br %mondriaan.pointer.test.0
-         *
-         * mondriaan.pointer.test.0:
-         *  %cond0 = icmp eq i32 %pointer, %0
-         *  br i1 %cond0, label %mondriaan.pointer.jmp.0, label
-         * %mondriaan.pointer.test.1
-         *
-         * mondriaan.pointer.test.1:
-         *  %cond1 = icmp eq i32 %pointer, %1
-         *  br i1 %cond1, label %mondriaan.pointer.jmp.1, label
-         * %mondriaan.pointer.test.2
-         *
-         * mondriaan.pointer.test.2:
-         *  %cond2 = icmp eq i32 %pointer, %2
-         *  br i1 %cond2, label %mondriaan.pointer.jmp.2, label
-         * %mondriaan.pointer.jmp.3
-         *
-         * mondriaan.pointer.jmp.0:
-         * mondriaan.pointer.jmp.1:
-         * mondriaan.pointer.jmp.2:
-         * mondriaan.pointer.jmp.3:
-         */
-
-        if (verifyFunction(*openFunction, &errs())) {
-          exit(1);
-        }
-        return openFunction;
-      } else {
-        cout << "Yet unsupported operation: "
-             << operationTable[transition->getHueChange()]
-                              [transition->getLightnessChange()]
-             << endl;
+  if (partitions == 1) {
+    objectStreams.clear();
+    translateIRToExecutable(objectFilenames.front());
+    return objectFilenames;
+  }
+
+  // Split the module into a partition per job. Each partition is compiled on
+  // a thread of its own, with its own context and target machine, so it can
+  // only move to its thread as bitcode.
+  vector<string> partitionBitcode;
+  auto writePartition = [&](std::unique_ptr<Module> partition) {
+    partitionBitcode.emplace_back();
+    raw_string_ostream bitcode(partitionBitcode.back());
+    WriteBitcodeToFile(*partition, bitcode);
+    bitcode.flush();
+  };
+  SplitModule(*module, partitions, writePartition);
+
+  auto compilePartition = [&](unsigned partition) {
+    Trace::startThread();
+    {
+      Trace::Span span("codegen partition", std::to_string(partition));
+      LLVMContext partitionContext;
+      auto partitionModule = parseBitcodeFile(
+          MemoryBufferRef(partitionBitcode[partition], "mondriaan.partition"),
+          partitionContext);
+      if (!partitionModule) {
+        errs() << toString(partitionModule.takeError()) << "\n";
+        exit(1);
       }
+      std::unique_ptr<TargetMachine> partitionMachine(buildTargetMachine());
+      emitObject(**partitionModule, *partitionMachine,
+                 *objectStreams[partition]);
     }
+    Trace::finishThread();
+  };
 
-    // End sequence if terminal node.
-    if (step->current->isTerminal()) {
-      if (translatedBranches[sequenceID]) {
-        openFunction->eraseFromParent();
-        return translatedBranches[sequenceID];
+  vector<std::thread> codegenThreads;
+  for (unsigned partition = 0; partition < partitionBitcode.size();
+       partition++) {
+    codegenThreads.emplace_back(compilePartition, partition);
+  }
+  for (auto &codegenThread : codegenThreads) {
+    codegenThread.join();
+  }
+  return objectFilenames;
+}
+
+Translator::PendingBranch Translator::queueBranch(Parse::GraphState entry) {
+  if (options.singleFunction) {
+    // Every state has exactly 1 block in main, which is translated once.
+    auto translated = stateBlocks.find(entry);
+    if (translated != stateBlocks.end()) {
+      return PendingBranch{entry, programFunction, translated->second};
+    }
+
+    BasicBlock *stateBlock =
+        BasicBlock::Create(context, "mondriaan_seq", programFunction);
+    stateBlocks[entry] = stateBlock;
+    pendingBranches.push_back(
+        PendingBranch{entry, programFunction, stateBlock});
+    return pendingBranches.back();
+  }
+
+  if (declareBranches) {
+    // The branch is only declared here. It's translated into a module of its
+    // own by the JIT once it's called, or by a worker thread. Its name only
+    // depends on its entry state, so every module declares it alike.
+    auto name = branchNames.find(entry);
+    if (name == branchNames.end()) {
+      name = branchNames.emplace(entry, branchName(entry)).first;
+      declaredBranches.emplace_back(name->second, entry);
+    }
+
+    return PendingBranch{entry, declareBranch(name->second), nullptr};
+  }
+
+  // Every state has exactly 1 function, however many paths lead to it.
+  auto translated = stateFunctions.find(entry);
+  if (translated != stateFunctions.end()) {
+    return PendingBranch{entry, translated->second, nullptr};
+  }
+
+  Function *branchFunction =
+      Function::Create(branchType(), Function::PrivateLinkage,
+                       branchName(entry), module.get());
+  BasicBlock *entryBlock =
+      BasicBlock::Create(context, "mondriaan_seq", branchFunction);
+  stateFunctions[entry] = branchFunction;
+  pendingBranches.push_back(PendingBranch{entry, branchFunction, entryBlock});
+  return pendingBranches.back();
+}
+
+CallInst *Translator::translateJump(Function *branch) {
+  // Branches call each other in cycles for as long as the program loops, so
+  // the call has to be a tail call at every optimisation level, or the native
+  // stack would overflow. The caller is a branch too, so the types match.
+  CallInst *call = builder.CreateCall(branch, {runtimeContext(builder)});
+  call->setTailCallKind(CallInst::TCK_MustTail);
+  builder.CreateRetVoid();
+  return call;
+}
+
+FunctionType *Translator::branchType() {
+  // A branch continues the program of the runtime context it's passed.
+  return FunctionType::get(Type::getVoidTy(context),
+                           {runtimeContextType(context)->getPointerTo()},
+                           false);
+}
+
+Function *Translator::declareBranch(const string &name) {
+  // The module may already declare the branch, if it calls it.
+  if (Function *function = module->getFunction(name)) {
+    return function;
+  }
+  return Function::Create(branchType(), Function::ExternalLinkage, name,
+                          module.get());
+}
+
+string Translator::branchName(Parse::GraphState entry) {
+  return "mondriaan.branch." + entry.node->getIdentifier() + "." +
+         to_string(entry.direction);
+}
+
+void Translator::translateOperation(const OpKeyType &operation,
+                                    Parse::GraphStep *step) {
+  if (options.inlineStack) {
+    inlineStack.translateOperation(operation, step);
+    return;
+  }
+
+  Value *runtime = runtimeContext(builder);
+  if (operation == OP_PUSH) {
+    vector<Value *> pushArgs;
+    pushArgs.push_back(runtime);
+    pushArgs.push_back(ConstantInt::get(Type::getInt64Ty(context),
+                                        APInt(64, step->previous->getSize())));
+    builder.CreateCall(push, pushArgs);
+  } else if (operation == OP_OUT_CHAR) {
+    builder.CreateCall(outChar, {runtime});
+  } else if (operation == OP_OUT_NUMBER) {
+    builder.CreateCall(outNumber, {runtime});
+  } else if (operation == OP_DUPLICATE) {
+    builder.CreateCall(duplicate, {runtime});
+  } else if (operation == OP_IN_NUMBER) {
+    builder.CreateCall(inNumber, {runtime});
+  } else if (operation == OP_IN_CHAR) {
+    builder.CreateCall(inChar, {runtime});
+  } else if (operation == OP_MULTIPLY) {
+    builder.CreateCall(multiply, {runtime});
+  } else if (operation == OP_DIVIDE) {
+    builder.CreateCall(divide, {runtime});
+  } else if (operation == OP_ROLL) {
+    builder.CreateCall(roll, {runtime});
+  } else {
+    cout << "Yet unsupported operation: " << operation << endl;
+  }
+}
+
+void Translator::translateDispatch(Value *selector, Parse::GraphNode *node,
+                                   const vector<DirectionPoint> &directions) {
+  assert(directions.size() >= 2);
+  BasicBlock *dispatchBlock = builder.GetInsertBlock();
+  Function *openFunction = dispatchBlock->getParent();
+
+  // A dispatch is profiled by its state, which is the same in every module.
+  string site = branchName({node, directions.front()});
+  if (options.instrument) {
+    translateProfileCount(site, selector, directions.size());
+  }
+
+  // Without a profile, the outcomes are tested in order. With one, the most
+  // frequent outcomes are tested first and the branches are weighted.
+  vector<size_t> outcomes;
+  for (size_t outcome = 0; outcome < directions.size(); outcome++) {
+    outcomes.push_back(outcome);
+  }
+  auto counts = profile.find(site);
+  bool profiled =
+      counts != profile.end() && counts->second.size() == directions.size();
+  if (profiled) {
+    std::stable_sort(outcomes.begin(), outcomes.end(),
+                     [&counts](size_t first, size_t second) {
+                       return counts->second[first] > counts->second[second];
+                     });
+  }
+  uint64_t total = 0;
+  uint64_t maximum = 0;
+  if (profiled) {
+    for (uint64_t count : counts->second) {
+      total += count;
+      maximum = std::max(maximum, count);
+    }
+  }
+  // Branch weights are 32-bit, so large counts are scaled down.
+  uint64_t weightDivisor = maximum / UINT32_MAX + 1;
+  MDBuilder metadata(context);
+
+  // Queue the branches, to be translated after this one.
+  vector<BasicBlock *> jumpBlocks;
+  for (DirectionPoint direction : directions) {
+    PendingBranch branch = queueBranch({node, direction});
+    if (options.singleFunction) {
+      jumpBlocks.push_back(branch.block);
+      continue;
+    }
+
+    BasicBlock *jumpBlock = BasicBlock::Create(
+        context, "mondriaan.dispatch.jmp." + to_string(jumpBlocks.size()),
+        openFunction);
+    builder.SetInsertPoint(jumpBlock);
+    CallInst *call = translateJump(branch.function);
+    if (profiled && total > 0 && counts->second[jumpBlocks.size()] == 0) {
+      // Never taken: keep the branch out of the hot path by not inlining it.
+      call->addFnAttr(Attribute::Cold);
+    }
+    jumpBlocks.push_back(jumpBlock);
+  }
+
+  if (options.singleFunction) {
+    /**
+     * mondriaan_seq:
+     *  %selector = call mondriaan_runtime_pointer
+     *  switch i8 %selector, label %seq.3 [ i8 0, label %seq.0
+     *                                      i8 1, label %seq.1
+     *                                      i8 2, label %seq.2 ]
+     */
+    builder.SetInsertPoint(dispatchBlock);
+    SwitchInst *dispatch = builder.CreateSwitch(
+        selector, jumpBlocks[outcomes.back()], (unsigned)outcomes.size() - 1);
+    for (size_t jump = 0; jump + 1 < outcomes.size(); jump++) {
+      dispatch->addCase(cast<ConstantInt>(ConstantInt::get(
+                            selector->getType(), outcomes[jump])),
+                        jumpBlocks[outcomes[jump]]);
+    }
+    if (profiled) {
+      // The default destination comes first, followed by the cases.
+      vector<uint32_t> weights{
+          (uint32_t)(counts->second[outcomes.back()] / weightDivisor)};
+      for (size_t jump = 0; jump + 1 < outcomes.size(); jump++) {
+        weights.push_back(
+            (uint32_t)(counts->second[outcomes[jump]] / weightDivisor));
       }
+      dispatch->setMetadata(LLVMContext::MD_prof,
+                            metadata.createBranchWeights(weights));
+    }
+    return;
+  }
 
-      // End the current block. Add it to the currently open function.
-      builder.CreateRetVoid();
-      openFunction->setName(sequenceID);
+  /**
+   * mondriaan_seq:
+   *  %selector = call mondriaan_runtime_pointer
+   *  br %mondriaan.dispatch.test.0
+   *
+   * mondriaan.dispatch.test.0:
+   *  %cond0 = icmp eq i8 %selector, 0
+   *  br i1 %cond0, label %mondriaan.dispatch.jmp.0, label
+   * %mondriaan.dispatch.test.1
+   *
+   * mondriaan.dispatch.test.1:
+   *  %cond1 = icmp eq i8 %selector, 1
+   *  br i1 %cond1, label %mondriaan.dispatch.jmp.1, label
+   * %mondriaan.dispatch.test.2
+   *
+   * mondriaan.dispatch.test.2:
+   *  %cond2 = icmp eq i8 %selector, 2
+   *  br i1 %cond2, label %mondriaan.dispatch.jmp.2, label
+   * %mondriaan.dispatch.jmp.3
+   *
+   * mondriaan.dispatch.jmp.0:
+   * mondriaan.dispatch.jmp.1:
+   * mondriaan.dispatch.jmp.2:
+   * mondriaan.dispatch.jmp.3:
+   */
+  BasicBlock *nextBlock = jumpBlocks[outcomes.back()];
+  uint64_t untested = profiled ? counts->second[outcomes.back()] : 0;
+  for (size_t jump = outcomes.size() - 1; jump > 0; jump--) {
+    size_t outcome = outcomes[jump - 1];
+    BasicBlock *testBlock = BasicBlock::Create(
+        context, "mondriaan.dispatch.test." + to_string(outcome),
+        openFunction);
+    builder.SetInsertPoint(testBlock);
+    Value *condition =
+        builder.CreateICmp(CmpInst::ICMP_EQ, selector,
+                           ConstantInt::get(selector->getType(), outcome));
+    BranchInst *test =
+        builder.CreateCondBr(condition, jumpBlocks[outcome], nextBlock);
+    if (profiled) {
+      test->setMetadata(LLVMContext::MD_prof,
+                        metadata.createBranchWeights(
+                            (uint32_t)(counts->second[outcome] / weightDivisor),
+                            (uint32_t)(untested / weightDivisor)));
+      untested += counts->second[outcome];
     }
+    nextBlock = testBlock;
   }
 
-  if (verifyFunction(*openFunction, &errs())) {
+  // Jump to the start of logic blocks in the dispatching block.
+  builder.SetInsertPoint(dispatchBlock);
+  builder.CreateBr(nextBlock);
+}
+
+void Translator::loadProfile() {
+  auto profileBuffer = MemoryBuffer::getFile(options.profileUse);
+  if (!profileBuffer) {
+    errs() << "Could not read the profile " << options.profileUse << ": "
+           << profileBuffer.getError().message() << "\n";
     exit(1);
   }
 
-  translatedBranches[sequenceID] = openFunction;
-  return openFunction;
+  // The first line names the program. Each line after it holds the name of a
+  // site followed by the count of each outcome.
+  SmallVector<StringRef, 64> lines;
+  (*profileBuffer)->getBuffer().split(lines, '\n', -1, false);
+  if (lines.empty() || lines[0] != "program " + options.programHash) {
+    errs() << "The profile " << options.profileUse
+           << " was recorded with another program.\n";
+    exit(1);
+  }
+  for (StringRef line : drop_begin(lines)) {
+    SmallVector<StringRef, 5> fields;
+    line.split(fields, ' ', -1, false);
+    vector<uint64_t> counts;
+    for (size_t field = 1; field < fields.size(); field++) {
+      uint64_t count;
+      if (fields[field].getAsInteger(10, count)) {
+        errs() << "Invalid profile " << options.profileUse << ": " << line
+               << "\n";
+        exit(1);
+      }
+      counts.push_back(count);
+    }
+    profile[fields[0].str()] = counts;
+  }
 }
 
-void Translator::translateToExecutable(string filename, bool onlyIR) {
-  registerPietGlobals();
-  Function *firstBranch =
-      translateBranch(graph->getInitialNode(), graph->getCurrentDirection());
+void Translator::translateProfileCount(const string &site, Value *selector,
+                                       size_t outcomes) {
+  // The counters of a site are shared by every dispatch of its state.
+  string countersName = "mondriaan.profile." + site;
+  GlobalVariable *counters = module->getNamedGlobal(countersName);
+  if (counters == nullptr) {
+    ArrayType *countersType =
+        ArrayType::get(Type::getInt64Ty(context), outcomes);
+    counters = new GlobalVariable(*module, countersType, false,
+                                  GlobalValue::PrivateLinkage,
+                                  ConstantAggregateZero::get(countersType),
+                                  countersName);
+    profileSites.push_back(site);
+  }
+
+  Value *counter = builder.CreateInBoundsGEP(
+      counters->getValueType(), counters,
+      {builder.getInt64(0), builder.CreateZExt(selector, builder.getInt64Ty())},
+      "counter");
+  Value *count =
+      builder.CreateLoad(Type::getInt64Ty(context), counter, "count");
+  builder.CreateStore(builder.CreateAdd(count, builder.getInt64(1)), counter);
+}
 
-  auto mainFunction = cast<Function>(module.getOrInsertFunction(
-      "main", IntegerType::getInt32Ty(context),
-      IntegerType::getInt32Ty(context), IntegerType::getInt8Ty(context)));
+void Translator::translateStatsCount(const OpKeyType &operation) {
+  // Operations are counted by their index in the Piet operation table.
+  uint32_t index = 0;
+  for (auto &hueOperations : operationTable) {
+    auto found = find(hueOperations.begin(), hueOperations.end(), operation);
+    if (found != hueOperations.end()) {
+      index += (uint32_t)(found - hueOperations.begin());
+      break;
+    }
+    index += (uint32_t)hueOperations.size();
+  }
+
+  // Without $MONDRIAAN_STATS, counting costs a load and a branch that's never
+  // taken.
+  Function *openFunction = builder.GetInsertBlock()->getParent();
+  BasicBlock *countBlock =
+      BasicBlock::Create(context, "mondriaan.stats", openFunction);
+  BasicBlock *continueBlock =
+      BasicBlock::Create(context, "mondriaan.stats.cont", openFunction);
+  Value *enabled = builder.CreateLoad(Type::getInt8Ty(context), statsEnabled,
+                                      "stats");
+  MDBuilder metadata(context);
+  builder.CreateCondBr(builder.CreateICmpNE(enabled, builder.getInt8(0)),
+                       countBlock, continueBlock,
+                       metadata.createBranchWeights(1, 1 << 20));
+
+  // The values of the sequence are on the stack as far as the statistics are
+  // concerned.
+  builder.SetInsertPoint(countBlock);
+  Value *depth = builder.getInt64(sequenceValues.size());
+  if (options.inlineStack) {
+    depth = builder.CreateAdd(depth, inlineStack.loadSize());
+  }
+  builder.CreateCall(statsCount, {runtimeContext(builder),
+                                  builder.getInt32(index), depth});
+  builder.CreateBr(continueBlock);
+  builder.SetInsertPoint(continueBlock);
+}
+
+void Translator::translateProfileRegistration() {
+  builder.CreateCall(profileProgram,
+                     {builder.CreateGlobalStringPtr(options.programHash)});
+  for (auto &site : profileSites) {
+    GlobalVariable *counters =
+        module->getNamedGlobal("mondriaan.profile." + site);
+    builder.CreateCall(
+        profileSite,
+        {builder.CreateGlobalStringPtr(site),
+         builder.CreateConstInBoundsGEP2_32(counters->getValueType(), counters,
+                                            0, 0),
+         builder.getInt32(
+             (uint32_t)counters->getValueType()->getArrayNumElements())});
+  }
+}
+
+void Translator::translateExit() {
+  // The program returns to whoever runs it, who owns its context.
+  builder.CreateRetVoid();
+}
+
+OpKeyType Translator::operationForStep(Parse::GraphStep *step) {
+  auto transition = !step->skipTransition
+                        ? ColorTransition::determineTransition(step->previous,
+                                                               step->current)
+                        : nullptr;
+  if (transition == nullptr) {
+    return OP_NOOP;
+  }
+
+  assert(transition->getHueChange() < operationTable.size());
+  assert(transition->getLightnessChange() <
+         operationTable[transition->getHueChange()].size());
+  string operation = operationTable[transition->getHueChange()]
+                                   [transition->getLightnessChange()];
+  assert(!operation.empty());
+  return operation;
+}
+
+void Translator::pushValue(Value *value) {
+  if (options.inlineStack) {
+    inlineStack.push(builder.CreateShl(value, 1));
+  } else {
+    builder.CreateCall(push, {runtimeContext(builder), value});
+  }
+}
+
+void Translator::materialiseSequenceValues() {
+  for (Value *value : sequenceValues) {
+    pushValue(value);
+  }
+  sequenceValues.clear();
+}
+
+void Translator::translateSequenceOperation(const OpKeyType &operation,
+                                            Parse::GraphStep *step) {
+  size_t depth = sequenceValues.size();
+
+  if (operation == OP_PUSH) {
+    sequenceValues.push_back(builder.getInt64(step->previous->getSize()));
+    return;
+  } else if (operation == OP_DUPLICATE && depth >= 1) {
+    sequenceValues.push_back(sequenceValues.back());
+    return;
+  } else if ((operation == OP_OUT_CHAR || operation == OP_OUT_NUMBER) &&
+             depth >= 1) {
+    Value *top = sequenceValues.back();
+    sequenceValues.pop_back();
+    // The runtime library takes the value tagged as a small integer.
+    builder.CreateCall(operation == OP_OUT_CHAR ? writeChar : writeNumber,
+                       {runtimeContext(builder), builder.CreateShl(top, 1)});
+    return;
+  } else if ((operation == OP_MULTIPLY || operation == OP_DIVIDE) &&
+             depth >= 2) {
+    auto top = dyn_cast<ConstantInt>(sequenceValues[depth - 1]);
+    auto second = dyn_cast<ConstantInt>(sequenceValues[depth - 2]);
+
+    // Dividing by zero is left to the stack, which decides what happens. A
+    // result that doesn't fit in a small integer is left to the stack too,
+    // which moves on to a bignum.
+    if (top && second && (operation == OP_MULTIPLY || !top->isZero())) {
+      bool overflow = false;
+      const APInt &secondValue = second->getValue();
+      APInt result = operation == OP_MULTIPLY
+                         ? secondValue.smul_ov(top->getValue(), overflow)
+                         : secondValue.sdiv_ov(top->getValue(), overflow);
+      if (!overflow && result.isSignedIntN(smallIntegerBits)) {
+        sequenceValues.resize(depth - 2);
+        sequenceValues.push_back(builder.getInt(result));
+        return;
+      }
+    }
+  } else if (operation == OP_ROLL && depth >= 2) {
+    // A roll of known values can be applied by reordering the values.
+    auto rolls = dyn_cast<ConstantInt>(sequenceValues[depth - 1]);
+    auto rollDepth = dyn_cast<ConstantInt>(sequenceValues[depth - 2]);
+    if (rolls && rollDepth && rollDepth->getSExtValue() > 0 &&
+        (uint64_t)rollDepth->getSExtValue() + 2 <= depth) {
+      sequenceValues.resize(depth - 2);
+      // A negative number of rolls rotates the other way.
+      int64_t rollDepthValue = rollDepth->getSExtValue();
+      int64_t shift = rolls->getSExtValue() % rollDepthValue;
+      if (shift < 0) {
+        shift += rollDepthValue;
+      }
+      rotate(sequenceValues.end() - rollDepthValue,
+             sequenceValues.end() - shift, sequenceValues.end());
+      return;
+    }
+  }
+
+  // The operation needs values from before the sequence: put the values of
+  // the sequence on the stack first.
+  materialiseSequenceValues();
+  translateOperation(operation, step);
+}
+
+Value *Translator::translateSelector(const OpKeyType &operation) {
+  uint8_t branches = operation == OP_POINTER ? 4 : 2;
+
+  if (!sequenceValues.empty()) {
+    Value *top = sequenceValues.back();
+    sequenceValues.pop_back();
+    materialiseSequenceValues();
+    // The lowest bits of the two's complement are the value modulo branches.
+    return builder.CreateTrunc(
+        builder.CreateAnd(top, builder.getInt64(branches - 1)),
+        Type::getInt8Ty(context), operation);
+  }
+
+  if (options.inlineStack) {
+    return inlineStack.popSelector(branches);
+  }
+
+  return builder.CreateCall(
+      operation == OP_POINTER ? pointerBranch : switchBranch,
+      {runtimeContext(builder)}, operation);
+}
+
+vector<DirectionPoint>
+Translator::dispatchDirections(const OpKeyType &operation,
+                               DirectionPoint direction) {
+  vector<DirectionPoint> directions{direction};
+  if (operation == OP_POINTER) {
+    for (uint8_t turn = 1; turn < 4; turn++) {
+      directions.push_back(incrementDirectionPointer(directions.back()));
+    }
+  } else {
+    directions.push_back(toggleCodelChooser(direction));
+  }
+  return directions;
+}
+
+string Translator::sequenceKey(Parse::GraphNode *entry,
+                               const vector<SequenceStep> &sequence,
+                               size_t loopStart,
+                               const Parse::GraphState *continuation) {
+  // The key holds everything the translated function depends on: the
+  // operations with their operands, where the sequence loops back to and the
+  // states it continues in. Debug info locates the function and every
+  // operation at their codels, so with -g only the same codels can share it.
+  auto location = [&](Parse::GraphNode *node) {
+    Parse::Position position = node->getPosition();
+    return "@" + to_string(position.row) + "," + to_string(position.column) +
+           " ";
+  };
+
+  string key;
+  if (options.debugInfo) {
+    key += location(entry);
+  }
+  for (size_t index = 0; index < sequence.size(); index++) {
+    if (index == loopStart) {
+      key += "loop ";
+    }
+    if (options.debugInfo) {
+      key += location(sequence[index].step->previous);
+    }
+
+    const OpKeyType &operation = sequence[index].operation;
+    key += operation;
+    if (operation == OP_PUSH) {
+      key += "(" + to_string(sequence[index].step->previous->getSize()) + ")";
+    } else if (operation == OP_POINTER || operation == OP_SWITCH) {
+      for (DirectionPoint direction :
+           dispatchDirections(operation, graph->getCurrentDirection())) {
+        key += " " + branchName({graph->getCurrentNode(), direction});
+      }
+    }
+    key += " ";
+  }
+
+  if (loopStart != SIZE_MAX) {
+    key += "end-loop";
+  } else if (continuation != nullptr) {
+    key += "tail " + branchName(*continuation);
+  } else if (sequence.empty() || sequence.back().step->current->isTerminal()) {
+    key += "exit";
+  }
+  return key;
+}
+
+void Translator::translateBranch(PendingBranch branch) {
+  Trace::Span span("translateBranch", branchName(branch.entry));
+  graph->restartWalk(branch.entry.node, branch.entry.direction);
+
+  // Walk the sequence up to its next control flow point first: its end, a
+  // pointer/switch instruction or a state that has a block to branch to.
+  vector<SequenceStep> sequence;
+  unordered_map<Parse::GraphState, size_t> walkedStates;
+  Parse::GraphState state = branch.entry;
+  BasicBlock *loopBlock = nullptr;
+  Function *continuation = nullptr;
+  size_t loopStart = SIZE_MAX;
+
+  while (true) {
+    walkedStates[state] = sequence.size();
+
+    // A walk starting on a terminal node has nothing left to do.
+    Parse::GraphStep *step = graph->walk();
+    if (step == nullptr) {
+      break;
+    }
+
+    OpKeyType operation = operationForStep(step);
+    sequence.push_back(SequenceStep{step, operation});
+    if (operation == OP_POINTER || operation == OP_SWITCH ||
+        step->current->isTerminal()) {
+      break;
+    }
+
+    // A walk returning to an earlier state loops. The walk can also continue
+    // in the block or function of a state that's already been queued, so
+    // that no state is translated twice.
+    state = graph->getCurrentState();
+    auto walked = walkedStates.find(state);
+    if (walked != walkedStates.end()) {
+      loopStart = walked->second;
+      break;
+    }
+    auto translated = stateBlocks.find(state);
+    if (options.singleFunction && translated != stateBlocks.end()) {
+      loopBlock = translated->second;
+      break;
+    }
+    auto translatedFunction = stateFunctions.find(state);
+    if (translatedFunction != stateFunctions.end()) {
+      continuation = translatedFunction->second;
+      break;
+    }
+  }
+
+  Function *openFunction = branch.function;
+  if (!options.singleFunction && !declareBranches) {
+    // States with the same operations and successors share a function.
+    string key = sequenceKey(branch.entry.node, sequence, loopStart,
+                             continuation != nullptr ? &state : nullptr);
+    auto translated = sequenceFunctions.find(key);
+    if (translated != sequenceFunctions.end()) {
+      openFunction->replaceAllUsesWith(translated->second);
+      openFunction->eraseFromParent();
+      stateFunctions[branch.entry] = translated->second;
+      return;
+    }
+    sequenceFunctions[key] = openFunction;
+  }
+
+  // Translate the walked sequence. Values pushed in the sequence are kept as
+  // SSA values until an operation needs values from before the sequence, or
+  // until the sequence ends.
+  builder.SetInsertPoint(branch.block);
+  if (options.singleFunction) {
+    translateDebugLocation(branch.entry.node);
+  } else {
+    attachDebugInfo(openFunction, branch.entry.node);
+    translateDebugLocation(branch.entry.node);
+  }
+  sequenceValues.clear();
+  for (size_t index = 0; index < sequence.size(); index++) {
+    // An operation is located at the block it leaves.
+    translateDebugLocation(sequence[index].step->previous);
+    if (index == loopStart) {
+      // The loop branches back to here, so the stack has to be complete.
+      materialiseSequenceValues();
+      loopBlock = BasicBlock::Create(context, "mondriaan_seq", openFunction);
+      builder.CreateBr(loopBlock);
+      builder.SetInsertPoint(loopBlock);
+      if (options.singleFunction) {
+        stateBlocks[state] = loopBlock;
+      }
+    }
+
+    const OpKeyType &operation = sequence[index].operation;
+    if (operation != OP_NOOP) {
+      translateStatsCount(operation);
+    }
+    if (operation == OP_POINTER || operation == OP_SWITCH) {
+      Value *selector = translateSelector(operation);
+      translateDispatch(
+          selector, graph->getCurrentNode(),
+          dispatchDirections(operation, graph->getCurrentDirection()));
+    } else if (operation != OP_NOOP) {
+      translateSequenceOperation(operation, sequence[index].step);
+    }
+  }
+
+  materialiseSequenceValues();
+  if (loopBlock != nullptr) {
+    builder.CreateBr(loopBlock);
+  } else if (continuation != nullptr) {
+    translateJump(continuation);
+  } else if (sequence.empty() || sequence.back().step->current->isTerminal()) {
+    translateExit();
+  }
+
+  if (!options.singleFunction && verifyFunction(*openFunction, &errs())) {
+    exit(1);
+  }
+}
+
+void Translator::translateGraph() {
+  // In a single function, the program starts in a block of its own: blocks
+  // of states can be branched to, but the entry block of a function can't.
+  BasicBlock *entryBlock =
+      BasicBlock::Create(context, "main_seq", programFunction);
+  PendingBranch firstBranch =
+      queueBranch({graph->getInitialNode(), graph->getCurrentDirection()});
+
+  // Translate each branch once, queueing the branches it jumps to instead of
+  // translating them recursively.
+  while (!pendingBranches.empty()) {
+    PendingBranch branch = pendingBranches.front();
+    pendingBranches.pop_front();
+    translateBranch(branch);
+  }
+
+  builder.SetInsertPoint(entryBlock);
+  translateDebugLocation(graph->getInitialNode());
+  if (options.singleFunction) {
+    builder.CreateBr(firstBranch.block);
+  } else {
+    translateJump(firstBranch.function);
+  }
+
+  // Declared branches are translated on worker threads instead, and linked
+  // into the module.
+  if (declareBranches && options.jobs > 1) {
+    translateDeclaredBranchesInParallel();
+  }
+}
+
+void Translator::translateMain() {
+  if (!options.profileUse.empty()) {
+    loadProfile();
+  }
+
+  // The program runs in the runtime context it's passed, so that a process
+  // can run it any number of times, on any number of threads.
+  programFunction = Function::Create(branchType(), Function::ExternalLinkage,
+                                     "mondriaan_program", module.get());
+  {
+    programFunction->arg_begin()->setName("context");
+
+    TimeReport::Phase translation("translation");
+    attachDebugInfo(programFunction, graph->getInitialNode());
+    translateGraph();
+    finishDebugInfo();
+    translation.end();
+
+    TimeReport::Phase verification("verification");
+    if (verifyFunction(*programFunction, &errs())) {
+      // TODO: throw parse exception to indicate Mondriaan bug.
+      exit(1);
+    }
+  }
+
+  // main runs the program once, on stdin and stdout.
+  Function *mainFunction = Function::Create(
+      FunctionType::get(IntegerType::getInt32Ty(context),
+                        {IntegerType::getInt32Ty(context),
+                         IntegerType::getInt8Ty(context)},
+                        false),
+      Function::ExternalLinkage, "main", module.get());
   {
     Function::arg_iterator args = mainFunction->arg_begin();
     args[0].setName("argc");
     args[1].setName("argv");
 
-    BasicBlock *entryBlock =
-        BasicBlock::Create(context, "main_seq", mainFunction);
-    builder.SetInsertPoint(entryBlock);
-    builder.CreateCall(firstBranch);
-    builder.CreateRet(ConstantInt::get(context, APInt(32, 0)));
+    PointerType *contextPtrTy = runtimeContextType(context)->getPointerTo();
+    Type *int32Ty = Type::getInt32Ty(context);
+    Function *createContext = Function::Create(
+        FunctionType::get(contextPtrTy, {int32Ty, int32Ty}, false),
+        Function::ExternalLinkage, "mondriaan_context_create", module.get());
+    Function *destroyContext = Function::Create(
+        FunctionType::get(Type::getVoidTy(context), {contextPtrTy}, false),
+        Function::ExternalLinkage, "mondriaan_context_destroy", module.get());
 
-    if (verifyFunction(*mainFunction, &errs())) {
-      // TODO: throw parse exception to indicate Mondriaan bug.
-      exit(1);
+    builder.SetInsertPoint(BasicBlock::Create(context, "entry", mainFunction));
+    builder.SetCurrentDebugLocation(DebugLoc());
+    if (options.instrument) {
+      translateProfileRegistration();
     }
+    Value *runtime = builder.CreateCall(
+        createContext, {builder.getInt32(0), builder.getInt32(1)}, "context");
+    builder.CreateCall(programFunction, {runtime});
+    builder.CreateCall(destroyContext, {runtime});
+    builder.CreateRet(builder.getInt32(0));
   }
 
-  if (verifyModule(module, &errs())) {
+  TimeReport::Phase verification("verification");
+  if (verifyModule(*module, &errs())) {
     // TODO: throw parse exception to indicate Mondriaan bug.
     exit(1);
   }
+}
+
+void Translator::translateDeclaredBranch(Parse::GraphState entry,
+                                         const string &name) {
+  Function *function = declareBranch(name);
+  BasicBlock *block = BasicBlock::Create(context, "mondriaan_seq", function);
+  translateBranch(PendingBranch{entry, function, block});
+}
+
+std::unique_ptr<Module>
+Translator::translateBranchModule(Parse::GraphState entry, const string &name) {
+  // Every lazily translated branch gets a module of its own.
+  module.reset(new Module("piet", context));
+  registerPietGlobals();
+  translateDeclaredBranch(entry, name);
+  finishDebugInfo();
+
+  configureModuleTarget();
+  optimiseModule();
+  return std::move(module);
+}
+
+void Translator::translateDeclaredBranchesInParallel() {
+  std::mutex mutex;
+  std::condition_variable workChanged;
+  deque<pair<string, Parse::GraphState>> work(declaredBranches.begin(),
+                                              declaredBranches.end());
+  unordered_set<string> queued;
+  for (auto &declared : declaredBranches) {
+    queued.insert(declared.first);
+  }
+  declaredBranches.clear();
+  unsigned busyWorkers = 0;
+
+  // Every worker translates branches into a module of its own, with a context
+  // of its own, walking a copy of the graph. The branches a worker declares
+  // are queued for any worker to translate.
+  vector<string> workerBitcode(options.jobs);
+  auto translateWork = [&](unsigned workerIndex) {
+    Trace::startThread();
+    Parse::Graph workerGraph = *graph;
+    Translator worker(&workerGraph, options);
+    worker.declareBranches = true;
+    worker.profile = profile;
+    worker.registerPietGlobals();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      workChanged.wait(lock,
+                       [&]() { return !work.empty() || busyWorkers == 0; });
+      if (work.empty()) {
+        break;
+      }
+
+      auto branch = work.front();
+      work.pop_front();
+      busyWorkers++;
+      lock.unlock();
+
+      worker.translateDeclaredBranch(branch.second, branch.first);
+
+      lock.lock();
+      for (auto &declared : worker.declaredBranches) {
+        if (queued.insert(declared.first).second) {
+          work.push_back(declared);
+        }
+      }
+      worker.declaredBranches.clear();
+      busyWorkers--;
+      workChanged.notify_all();
+    }
+    lock.unlock();
+
+    // The module can only leave the context of the worker as bitcode.
+    worker.finishDebugInfo();
+    raw_string_ostream bitcode(workerBitcode[workerIndex]);
+    WriteBitcodeToFile(*worker.module, bitcode);
+    bitcode.flush();
+    Trace::finishThread();
+  };
+
+  vector<std::thread> workers;
+  for (unsigned workerIndex = 0; workerIndex < options.jobs; workerIndex++) {
+    workers.emplace_back(translateWork, workerIndex);
+  }
+  for (auto &workerThread : workers) {
+    workerThread.join();
+  }
+
+  for (auto &bitcode : workerBitcode) {
+    auto workerModule = parseBitcodeFile(
+        MemoryBufferRef(bitcode, "mondriaan.worker"), context);
+    if (!workerModule) {
+      errs() << toString(workerModule.takeError()) << "\n";
+      exit(1);
+    }
+    if (llvm::Linker::linkModules(*module, std::move(*workerModule))) {
+      exit(1);
+    }
+  }
+
+  // The branches are only called from within the module.
+  for (auto &branchName : queued) {
+    module->getFunction(branchName)->setLinkage(Function::PrivateLinkage);
+  }
+}
+
+string Translator::outputFilename(const string &filename, bool onlyIR,
+                                  const TranslatorOptions &options) {
+  return onlyIR || options.link ? filename : filename + ".o";
+}
+
+void Translator::translateToExecutable(string filename, bool onlyIR) {
+  // The graph is translated on several threads in a function per branch. A
+  // stack or function shared by all branches is translated on 1 thread.
+  // Profiled sites are registered by main, so they have to be known first.
+  declareBranches = options.jobs > 1 && !options.singleFunction &&
+                    !options.inlineStack && !options.instrument;
+
+  registerPietGlobals();
+  translateMain();
+
+  if (options.linkRuntime) {
+    linkRuntime();
+  }
 
-  // Optimise, please?
+  createTargetMachine();
+  optimiseModule();
 
+  TimeReport::Phase codegen("codegen");
   if (onlyIR) {
     std::error_code writeError;
-    auto outputStream = raw_fd_ostream(filename, writeError, sys::fs::F_None);
-    module.print(outputStream, nullptr);
+    raw_fd_ostream outputStream(filename, writeError, sys::fs::OF_None);
+    module->print(outputStream, nullptr);
+  } else if (options.link || options.jobs > 1) {
+    // The object files are temporary: they're linked into an executable, or
+    // combined into a single object file.
+    std::unique_ptr<Linker> linker(options.link ? new Linker : nullptr);
+    auto objectFilenames = translateIRToObjects();
+    codegen.end();
+
+    TimeReport::Phase linking("linking");
+    auto outputFilename = Translator::outputFilename(filename, onlyIR, options);
+    bool linked = options.link
+                      ? linker->link(objectFilenames, outputFilename)
+                      : Linker::combine(objectFilenames, outputFilename);
+    for (auto &objectFilename : objectFilenames) {
+      sys::fs::remove(objectFilename);
+    }
+    if (!linked) {
+      exit(1);
+    }
+    std::cout << "Created " << outputFilename << std::endl;
   } else {
     translateIRToExecutable(filename + ".o");
     std::cout << "Created " << filename + ".o" << std::endl;
@@ -0,0 +1,55 @@
+#!/usr/bin/env bash
+
+# Assumes `mondriaan` is built in build/
+# Assumes that the runtime library is built in lib/build/src/
+
+exit_code=0
+
+# The programs below never stop. Each time around their loop is a call between
+# branches, so on a small stack they only keep going if those calls are tail
+# calls, which -O0 doesn't make by itself.
+ulimit -s 1024
+bytes=1000000
+
+# Test loop: loop.png prints "1" forever
+base_1=$(mktemp -d /tmp/mondriaan-loop.XXXXXX)
+prog_1="${base_1}/loop"
+c_output_1=$(../../../build/mondriaan -O0 --output-file "$prog_1" loop.png)
+LIBRARY_PATH=../../../lib/build/src/ clang++ "${prog_1}.o" -lMondriaanRuntime -o "${prog_1}"
+output_1=$("${prog_1}" | head -c "$bytes" | wc -c)
+if [[ "$output_1" != "$bytes" ]]; then
+	echo "Failed test 'loop'"
+	echo "Expected ${bytes} bytes but received ${output_1}"
+	echo "Compiler output: ${c_output_1}"
+	exit_code=1
+fi
+rm -r "${base_1}"
+
+# Test loop-run: the same loop in the JIT
+output_2=$(../../../build/mondriaan --run -O0 loop.png | head -c "$bytes" | wc -c)
+if [[ "$output_2" != "$bytes" ]]; then
+	echo "Failed test 'loop-run'"
+	echo "Expected ${bytes} bytes but received ${output_2}"
+	exit_code=1
+fi
+
+# Test memoised: memoised.png prints a character forever, and its loop walks
+# into the first state again, which is called as its memoised branch function
+base_3=$(mktemp -d /tmp/mondriaan-loop.XXXXXX)
+prog_3="${base_3}/memoised"
+c_output_3=$(../../../build/mondriaan -O0 --output-file "$prog_3" memoised.png)
+LIBRARY_PATH=../../../lib/build/src/ clang++ "${prog_3}.o" -lMondriaanRuntime -o "${prog_3}"
+output_3=$("${prog_3}" < /dev/null | head -c "$bytes" | wc -c)
+if [[ "$output_3" != "$bytes" ]]; then
+	echo "Failed test 'memoised'"
+	echo "Expected ${bytes} bytes but received ${output_3}"
+	echo "Compiler output: ${c_output_3}"
+	exit_code=1
+fi
+rm -r "${base_3}"
+
+# Report success, if any
+if [[ ${exit_code} -eq 0 ]]; then
+	echo "Integration tests passed 🎉"
+fi
+exit ${exit_code}
@@ -0,0 +1,65 @@
+#!/usr/bin/env bash
+
+# Assumes `mondriaan` is built in build/
+# Assumes that the runtime library is built in lib/build/src/
+
+exit_code=0
+base=$(mktemp -d /tmp/mondriaan-profile.XXXXXX)
+export MONDRIAAN_PROFILE="${base}/profile"
+pointer_test=../../../examples/PointerTest.png
+
+# Test run-instrument: the JIT writes the profile before it unloads the program
+output_1=$(echo 3 | ../../../build/mondriaan --run --instrument "$pointer_test")
+status_1=$?
+profile_1=$(cat "$MONDRIAAN_PROFILE")
+if [[ "$status_1" != "0" || "$output_1" != "1" ]]; then
+	echo "Failed test 'run-instrument'"
+	echo "Expected '1' and status 0 but received '${output_1}' and status ${status_1}"
+	exit_code=1
+fi
+if [[ "$profile_1" != "program "* || $(wc -l <<< "$profile_1") -lt 2 ]]; then
+	echo "Failed test 'run-instrument'"
+	echo "Expected a profile of PointerTest but received '${profile_1}'"
+	exit_code=1
+fi
+
+# Test run-instrument-again: a second run adds its counts to the profile
+echo 3 | ../../../build/mondriaan --run --instrument "$pointer_test" > /dev/null
+profile_2=$(cat "$MONDRIAAN_PROFILE")
+if [[ "$profile_2" == "$profile_1" || $(wc -l <<< "$profile_2") != $(wc -l <<< "$profile_1") ]]; then
+	echo "Failed test 'run-instrument-again'"
+	echo "Expected the counts of 2 runs but received '${profile_2}'"
+	exit_code=1
+fi
+
+# Test profile-use: the profile of PointerTest is used to compile PointerTest
+prog="${base}/PointerTest"
+c_output=$(../../../build/mondriaan --profile-use "$MONDRIAAN_PROFILE" --output-file "$prog" "$pointer_test")
+LIBRARY_PATH=../../../lib/build/src/ clang++ "${prog}.o" -lMondriaanRuntime -o "${prog}"
+output_3=$(echo 3 | "${prog}")
+if [[ "$output_3" != "1" ]]; then
+	echo "Failed test 'profile-use'"
+	echo "Expected '1' but received '${output_3}'"
+	echo "Compiler output: ${c_output}"
+	exit_code=1
+fi
+
+# Test other-program: the profile of another program is replaced, and refused
+../../../build/mondriaan --run --instrument ../pi/pi-small.png > /dev/null
+if [[ "$(cat "$MONDRIAAN_PROFILE")" != "program "* || "$(head -n 1 "$MONDRIAAN_PROFILE")" == "$(head -n 1 <<< "$profile_1")" ]]; then
+	echo "Failed test 'other-program'"
+	echo "Expected the profile of PointerTest to be replaced"
+	exit_code=1
+fi
+if ../../../build/mondriaan --profile-use "$MONDRIAAN_PROFILE" --output-file "$prog" "$pointer_test" > /dev/null 2>&1; then
+	echo "Failed test 'other-program'"
+	echo "Expected the profile of pi-small to be refused for PointerTest"
+	exit_code=1
+fi
+rm -r "${base}"
+
+# Report success, if any
+if [[ ${exit_code} -eq 0 ]]; then
+	echo "Integration tests passed 🎉"
+fi
+exit ${exit_code}
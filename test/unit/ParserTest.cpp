@@ -87,6 +87,49 @@ BOOST_AUTO_TEST_CASE(test_parse_2_block_image) {
   }
 }
 
+BOOST_AUTO_TEST_CASE(test_walk_returns_to_state) {
+  {
+    // Test that walking a 2-block loop returns to the state it started from.
+    auto image = new Image({{Red, Blue}}, 1, 2);
+    auto parser = new Parser(image);
+    auto graph = parser->parse();
+
+    graph->restartWalk(graph->getInitialNode(), RightTop);
+    auto initialState = graph->getCurrentState();
+    BOOST_CHECK(initialState.node == graph->getInitialNode());
+    BOOST_CHECK(initialState.direction == RightTop);
+
+    // Red to blue and back again.
+    graph->walk();
+    BOOST_CHECK(!(graph->getCurrentState() == initialState));
+    graph->walk();
+    auto loopState = graph->getCurrentState();
+    BOOST_CHECK(loopState.node == initialState.node);
+
+    // From here on the walk repeats itself.
+    graph->walk();
+    graph->walk();
+    BOOST_CHECK(graph->getCurrentState() == loopState);
+    BOOST_CHECK(hash<GraphState>()(graph->getCurrentState()) ==
+                hash<GraphState>()(loopState));
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_node_positions) {
+  {
+    // Test that nodes know where their block is in the image.
+    auto image = new Image({{Red, Red, Blue}, {Green, Green, Blue}}, 2, 3);
+    auto parser = new Parser(image);
+    auto graph = parser->parse();
+
+    auto step = graph->walk();
+    BOOST_CHECK_EQUAL(0, step->previous->getPosition().row);
+    BOOST_CHECK_EQUAL(0, step->previous->getPosition().column);
+    BOOST_CHECK(step->current->getColor() == Blue);
+    BOOST_CHECK_EQUAL(2, step->current->getPosition().column);
+  }
+}
+
 BOOST_AUTO_TEST_CASE(test_termination) {
   {
     // Test with a simple image that only terminates.